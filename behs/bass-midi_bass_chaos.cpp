@@ -4,10 +4,23 @@
 #include <lv2/atom/util.h>
 #include <lv2/atom/forge.h>
 #include <lv2/midi/midi.h>
+#include <lv2/state/state.h>
 #include <cmath>
 #include <cstring>
+#include <new>
 #include <stdlib.h>
 
+#include "cc_map.h"
+#include "chaos_table.h"
+#include "note_set.h"
+#include "state_notify.h"
+#include "tempo_tracker.h"
+#include "trace.h"
+
+#ifdef CHAOS_FOOTPRINT
+#include "footprint.h"
+#endif
+
 #define BASS_CHAOS_URI "http://github.com/danja/midi-bass-chaos"
 
 enum PortIndex {
@@ -18,42 +31,132 @@ enum PortIndex {
     BASS_VELOCITY   = 4,
     BASS_CHANNEL    = 5,
     REGGAE_MODE     = 6,
-    SPARSITY        = 7
+    SPARSITY        = 7,
+    CC_LEARN        = 8,
+    TEMPO_BPM       = 9,
+    TEMPO_PHASE     = 10,
+    PHRASE_MODE     = 11,
+    NOTIFY          = 12,
+    CHAOS_AMOUNT    = 13
+};
+
+// Phrase mode plays one bar of eight 8th-note steps generated a bar ahead
+static const int PHRASE_STEPS = 8;
+
+struct PhraseStep {
+    int8_t interval;  // Semitones from the incoming root
+    int8_t accent;    // Velocity offset from Bass Velocity
+    bool play;
+};
+
+// Bar-long motifs as intervals from the root
+static const int8_t phrase_motifs[8][PHRASE_STEPS] = {
+    {0, 0, 12, 0, 7, 0, 12, 7},     // Root pump
+    {0, 7, 12, 7, 0, 7, 10, 7},     // Fifth bounce
+    {0, 0, 3, 5, 7, 5, 3, 0},       // Minor walk
+    {0, 12, 0, 12, 7, 7, 5, 5},     // Octave drop
+    {0, -5, 0, 3, 0, -5, -2, 0},    // Dub
+    {0, 0, 7, 7, 5, 5, 3, 3},       // Descending pairs
+    {0, 4, 7, 9, 12, 9, 7, 4},      // Major walk
+    {0, -12, 0, 7, 0, -12, 5, 7}    // Octave stab
+};
+
+// Which steps play (bit per step), straight and reggae sets
+static const uint8_t phrase_rhythms[2][4] = {
+    {0xFF, 0x55, 0xBB, 0xEE},       // Straight: all, downbeats, dotted
+    {0xAA, 0xAB, 0xEA, 0xBA}        // Reggae: off-beats first
+};
+
+// Folds root + interval (index offset by 12) into the bass range E1-E4
+struct BassRangeTable {
+    uint8_t note[128 + 24];
+    
+    BassRangeTable() {
+        for (int i = 0; i < 128 + 24; i++) {
+            int n = i - 12;
+            while (n > 64) n -= 12;
+            while (n < 28) n += 12;
+            note[i] = (uint8_t)n;
+        }
+    }
 };
 
+static const BassRangeTable bass_range;
+
+// Reggae intervals (from root): root, octave down, 5th, 5th down, 3rd, 6th down
+static const int8_t reggae_intervals[6] = {0, -12, 7, -5, 3, -9};
+
+// Simple intervals: unison, octave, 5th, 3rd
+static const int8_t simple_intervals[7] = {0, -12, 12, 7, -5, 3, -9};
+
 typedef struct {
     LV2_URID atom_Blank;
     LV2_URID atom_Sequence;
     LV2_URID midi_MidiEvent;
+    LV2_URID atom_Chunk;
+    LV2_URID state_ccMap;
 } URIDs;
 
-class BassChaos {
+// Members are ordered hot first: what every block touches, then what a
+// trigger touches, then setup-only state
+class alignas(64) BassChaos {
 private:
+    // Every block
+    const LV2_Atom_Sequence* midi_in;
+    LV2_Atom_Sequence* midi_out;
+    LV2_Atom_Forge forge;  // Initialised once, only the buffer changes per block
     URIDs urids;
-    LV2_URID_Map* map;
+    uint64_t sample_clock;
+    CCModulation cc;       // MIDI CC control of chaos parameters
+    const float* chaos_k;
+    const float* chaos_intensity;
+    const float* sparsity;
+    const float* cc_learn;
+    float* tempo_bpm;
+    float* tempo_phase;
+    const float* phrase_mode;
+    bool phrase_active;
     
+    // Every trigger
     double chaos_x;
     int beat_count;
-    
-    // Reggae intervals (from root)
-    int reggae_intervals[6] = {0, -12, 7, -5, 3, -9}; // root, octave down, 5th, 5th down, 3rd, 6th down
-    
-    // Active notes tracking
-    bool active_notes[128];
     uint8_t last_root;
-    
-    // Ports
-    const LV2_Atom_Sequence* midi_in;
-    LV2_Atom_Sequence* midi_out;
-    const float* chaos_k;
-    const float* chaos_intensity;
+    NoteSet active_notes;  // Active notes tracking
     const float* bass_velocity;
     const float* bass_channel;
     const float* reggae_mode;
-    const float* sparsity;
+    const float* chaos_amount;
+    const ChaosTable* chaos_table;  // Shared, built at the first instantiate
+    
+    // Phrase mode: the bar playing now and the next bar, filled one step
+    // per trigger so each trigger does a constant amount of work
+    int phrase_bar;
+    int next_motif;
+    uint8_t next_rhythm;
+    PhraseStep phrase[2][PHRASE_STEPS];
+    
+    // Tempo estimated from incoming notes
+    TempoTracker tempo;
+    
+    // Step and sounding notes for UIs
+    LV2_Atom_Sequence* notify;
+    StateNotifier notifier;
+    
+    LV2_URID_Map* map;
+    
+#ifdef CHAOS_TRACE
+    TraceRing trace;
+#endif
+    
+    float getChaosK() {
+        // Chaos Amount above zero takes over from the raw K
+        float amount = chaos_amount ? *chaos_amount : 0.0f;
+        if (amount > 0.0f) return chaos_table->kForAmount(amount);
+        return cc.get(CC_PARAM_CHAOS_K, chaos_k, 3.8f);
+    }
     
     void generateChaos() {
-        double k = chaos_k ? fmax(1.0, fmin(4.0, *chaos_k)) : 3.8;
+        double k = fmax(1.0, fmin(4.0, getChaosK()));
         chaos_x = k * chaos_x * (1.0 - chaos_x);
         if (chaos_x <= 0.0 || chaos_x >= 1.0) chaos_x = 0.5;
     }
@@ -65,15 +168,13 @@ private:
         if (reggae) {
             return reggae_intervals[(int)(chaos_x * 5.999)];
         } else {
-            // Simple intervals: unison, octave, 5th, 3rd
-            int simple_intervals[] = {0, -12, 12, 7, -5, 3, -9};
             return simple_intervals[(int)(chaos_x * 6.999)];
         }
     }
     
     bool shouldTrigger() {
         generateChaos();
-        float sparse_level = sparsity ? fmax(0.0f, fmin(1.0f, *sparsity)) : 0.0f;
+        float sparse_level = fmax(0.0f, fmin(1.0f, cc.get(CC_PARAM_SPARSITY, sparsity, 0.0f)));
         
         // Reggae syncopation pattern
         bool reggae = reggae_mode ? (*reggae_mode > 0.5f) : false;
@@ -88,14 +189,74 @@ private:
         return chaos_x > sparse_level;
     }
     
+    uint8_t getBaseVelocity() {
+        return bass_velocity ? (uint8_t)fmax(1, fmin(127, *bass_velocity)) : 90;
+    }
+    
+    float getIntensity() {
+        return fmax(0.0f, fmin(1.0f, cc.get(CC_PARAM_CHAOS_INTENSITY, chaos_intensity, 0.3f)));
+    }
+    
+    int velocityVariation() {
+        generateChaos();
+        return (int)(chaos_x * getIntensity() * 30) - 15;
+    }
+    
     uint8_t getBassVelocity() {
+        // Add some velocity variation
+        return (uint8_t)fmax(1, fmin(127, getBaseVelocity() + velocityVariation()));
+    }
+    
+    bool getPhraseMode() {
+        return phrase_mode ? (*phrase_mode > 0.5f) : false;
+    }
+    
+    // Fill step `pos` of the next bar; motif and rhythm are picked at step 0
+    void generatePhraseStep(int pos) {
+        PhraseStep& step = phrase[phrase_bar ^ 1][pos];
+        
+        if (pos == 0) {
+            bool reggae = reggae_mode ? (*reggae_mode > 0.5f) : false;
+            generateChaos();
+            next_motif = (int)(chaos_x * 7.999);
+            generateChaos();
+            next_rhythm = phrase_rhythms[reggae ? 1 : 0][(int)(chaos_x * 3.999)];
+        }
+        
+        // Rhythm steps survive sparsity, other steps are occasional fills
+        float sparse_level = fmax(0.0f, fmin(1.0f, cc.get(CC_PARAM_SPARSITY, sparsity, 0.0f)));
         generateChaos();
-        uint8_t base_vel = bass_velocity ? (uint8_t)fmax(1, fmin(127, *bass_velocity)) : 90;
+        step.play = ((next_rhythm >> pos) & 1) ? (chaos_x > sparse_level)
+                                                : (chaos_x < getIntensity() * 0.3);
+        step.interval = phrase_motifs[next_motif][pos];
+        step.accent = (int8_t)velocityVariation();
+    }
+    
+    // Generate a whole bar and make it current (used when phrase mode starts)
+    void generatePhrase() {
+        TRACE_SPAN(span, trace, TRACE_PHRASE);
+        TRACE_ARGS(span, PHRASE_STEPS, 0);
+        for (int pos = 0; pos < PHRASE_STEPS; pos++) generatePhraseStep(pos);
+        phrase_bar ^= 1;
+    }
+    
+    // Play the precomputed step and compute the same step of the next bar
+    void playPhraseStep(LV2_Atom_Forge* forge, uint32_t frames) {
+        int pos = (beat_count - 1) % PHRASE_STEPS;
+        const PhraseStep& step = phrase[phrase_bar][pos];
         
-        // Add some velocity variation
-        float intensity = chaos_intensity ? fmax(0.0f, fmin(1.0f, *chaos_intensity)) : 0.3f;
-        int variation = (int)(chaos_x * intensity * 30) - 15;
-        return (uint8_t)fmax(1, fmin(127, base_vel + variation));
+        if (step.play) {
+            uint8_t note = bass_range.note[last_root + step.interval + 12];
+            uint8_t velocity = (uint8_t)fmax(1, fmin(127, getBaseVelocity() + step.accent));
+            writeBassNote(forge, frames, note, velocity, true);
+        }
+        
+        generatePhraseStep(pos);
+        if (pos == PHRASE_STEPS - 1) phrase_bar ^= 1;
+    }
+    
+    uint8_t getCCLearn() {
+        return cc_learn ? (uint8_t)fmax(0, fmin(CC_NUM_PARAMS - 1, *cc_learn)) : 0;
     }
     
     uint8_t getBassChannel() {
@@ -116,19 +277,18 @@ private:
         lv2_atom_forge_raw(forge, midi_msg, 3);
         lv2_atom_forge_pad(forge, 3);
         
-        active_notes[note] = note_on;
+        if (note_on) active_notes.set(note);
+        else active_notes.reset(note);
     }
     
     void stopActiveNotes(LV2_Atom_Forge* forge, uint32_t frames) {
-        for (int i = 0; i < 128; i++) {
-            if (active_notes[i]) {
-                writeBassNote(forge, frames, i, 0, false);
-            }
+        for (int i = active_notes.next(0); i >= 0; i = active_notes.next(i + 1)) {
+            writeBassNote(forge, frames, i, 0, false);
         }
     }
     
 public:
-    BassChaos(double rate, const LV2_Feature* const* features) : chaos_x(0.5), beat_count(0), last_root(60) {
+    BassChaos(double rate, const LV2_Feature* const* features) : sample_clock(0), chaos_x(0.5), beat_count(0), last_root(60) {
         map = nullptr;
         midi_in = nullptr;
         midi_out = nullptr;
@@ -138,8 +298,27 @@ public:
         bass_channel = nullptr;
         reggae_mode = nullptr;
         sparsity = nullptr;
+        cc_learn = nullptr;
+        tempo_bpm = nullptr;
+        tempo_phase = nullptr;
+        phrase_mode = nullptr;
+        notify = nullptr;
+        chaos_amount = nullptr;
+        chaos_table = &chaosTable();
+        
+        memset(phrase, 0, sizeof(phrase));
+        phrase_bar = 0;
+        next_motif = 0;
+        next_rhythm = 0;
+        phrase_active = false;
         
-        memset(active_notes, 0, sizeof(active_notes));
+        cc.init();
+        tempo.init(rate, 2); // Reggae patterns count 8th notes
+        
+        active_notes.clear();
+#ifdef CHAOS_TRACE
+        trace.init();
+#endif
         
         if (features) {
             for (int i = 0; features[i]; i++) {
@@ -154,10 +333,23 @@ public:
             urids.atom_Blank = map->map(map->handle, LV2_ATOM__Blank);
             urids.atom_Sequence = map->map(map->handle, LV2_ATOM__Sequence);
             urids.midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+            urids.atom_Chunk = map->map(map->handle, LV2_ATOM__Chunk);
+            urids.state_ccMap = map->map(map->handle, BASS_CHAOS_URI "#cc_map");
+            lv2_atom_forge_init(&forge, map);
+            notifier.init(map, BASS_CHAOS_URI, rate, 4, false);
         }
     }
     
+#ifdef CHAOS_TRACE
+    ~BassChaos() { trace.dump("bass"); }
+#endif
+    
     void connectPort(uint32_t port, void* data) {
+        // The notify port is optional and may be disconnected with NULL
+        if (port == NOTIFY) {
+            notify = (LV2_Atom_Sequence*)data;
+            return;
+        }
         if (!data) return;
         
         switch (port) {
@@ -169,41 +361,72 @@ public:
             case BASS_CHANNEL: bass_channel = (const float*)data; break;
             case REGGAE_MODE: reggae_mode = (const float*)data; break;
             case SPARSITY: sparsity = (const float*)data; break;
+            case CC_LEARN: cc_learn = (const float*)data; break;
+            case TEMPO_BPM: tempo_bpm = (float*)data; break;
+            case TEMPO_PHASE: tempo_phase = (float*)data; break;
+            case PHRASE_MODE: phrase_mode = (const float*)data; break;
+            case CHAOS_AMOUNT: chaos_amount = (const float*)data; break;
         }
     }
     
+    LV2_State_Status saveState(LV2_State_Store_Function store, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        return cc.save(store, handle, urids.state_ccMap, urids.atom_Chunk);
+    }
+    
+    LV2_State_Status restoreState(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        return cc.restore(retrieve, handle, urids.state_ccMap, urids.atom_Chunk);
+    }
+    
     void run(uint32_t n_samples) {
         if (!midi_in || !midi_out || !map) return;
+        TRACE_SPAN(run_span, trace, TRACE_RUN);
         
         const uint32_t out_capacity = midi_out->atom.size;
-        LV2_Atom_Forge forge;
-        lv2_atom_forge_init(&forge, map);
         lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_out, out_capacity);
         
         LV2_Atom_Forge_Frame seq_frame;
         lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
         
+        // Control ports moved by the host take over from earlier CCs
+        cc.sync(CC_PARAM_CHAOS_K, chaos_k);
+        cc.sync(CC_PARAM_CHAOS_INTENSITY, chaos_intensity);
+        cc.sync(CC_PARAM_SPARSITY, sparsity);
+        uint8_t learn_param = getCCLearn();
+        
+        // Entering phrase mode: generate the first bar from the next trigger on
+        bool use_phrase = getPhraseMode();
+        if (use_phrase && !phrase_active) {
+            beat_count = 0;
+            generatePhrase();
+        }
+        phrase_active = use_phrase;
+        
         LV2_ATOM_SEQUENCE_FOREACH(midi_in, ev) {
             if (ev->body.type == urids.midi_MidiEvent) {
                 const uint8_t* const msg = (const uint8_t*)(ev + 1);
                 
-                if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
+                if ((msg[0] & 0xF0) == 0xB0) {
+                    // CC modulation takes effect from this frame on
+                    cc.controlChange(msg[1], msg[2], learn_param);
+                }
+                else if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
                     // Note on - generate bass line
+                    TRACE_SPAN(span, trace, TRACE_TRIGGER);
                     beat_count++;
                     last_root = msg[1];
+                    tempo.onset(sample_clock + ev->time.frames);
                     
-                    if (shouldTrigger()) {
-                        int interval = selectInterval();
-                        int bass_note = last_root + interval;
-                        
-                        // Keep in bass range (E1 to E4: 28-64)
-                        while (bass_note > 64) bass_note -= 12;
-                        while (bass_note < 28) bass_note += 12;
-                        
-                        if (bass_note >= 28 && bass_note <= 64) {
-                            writeBassNote(&forge, ev->time.frames, bass_note, getBassVelocity(), true);
-                        }
+                    if (phrase_active) {
+                        playPhraseStep(&forge, ev->time.frames);
                     }
+                    else if (shouldTrigger()) {
+                        // Folded into the bass range (E1 to E4: 28-64)
+                        uint8_t bass_note = bass_range.note[last_root + selectInterval() + 12];
+                        writeBassNote(&forge, ev->time.frames, bass_note, getBassVelocity(), true);
+                    }
+                    TRACE_ARGS(span, beat_count, active_notes.count());
                 }
                 else if ((msg[0] & 0xF0) == 0x80 || ((msg[0] & 0xF0) == 0x90 && msg[2] == 0)) {
                     // Note off - stop active bass notes
@@ -213,14 +436,87 @@ public:
         }
         
         lv2_atom_forge_pop(&forge, &seq_frame);
+        
+        if (notify) {
+            TRACE_SPAN(span, trace, TRACE_NOTIFY);
+            // Lanes are the sounding notes, 32 per word
+            StateSnapshot snapshot = {};
+            snapshot.step = beat_count;
+            snapshot.chord = -1;
+            snapshot.chaos = (float)chaos_x;
+            memcpy(snapshot.lanes, active_notes.bits, sizeof(active_notes.bits));
+            bool published = notifier.run(notify, sample_clock, n_samples ? n_samples - 1 : 0, snapshot);
+            TRACE_ARGS(span, published, 0);
+            (void)published;
+        }
+        
+        sample_clock += n_samples;
+        if (tempo_bpm) *tempo_bpm = tempo.bpm();
+        if (tempo_phase) *tempo_phase = tempo.phase(sample_clock);
+        TRACE_ARGS(run_span, traceCountEvents(midi_in), traceCountEvents(midi_out));
     }
+    
+#ifdef CHAOS_FOOTPRINT
+    // Mark the members run() reads and writes, per block and per trigger
+    static void reportFootprint() {
+        BassChaos instance(48000.0, nullptr);
+        BassChaos* p = &instance;
+        FootprintReport report(p, sizeof(BassChaos));
+        report.shared(phrase_motifs);
+        report.shared(phrase_rhythms);
+        report.shared(bass_range);
+        report.shared(reggae_intervals);
+        report.shared(simple_intervals);
+        report.shared(chaosTable());
+        
+        report.block(p->midi_in);
+        report.block(p->midi_out);
+        report.block(p->forge);
+        report.block(p->urids);
+        report.block(p->sample_clock);
+        report.block(p->cc.params);
+        report.block(p->chaos_k);
+        report.block(p->chaos_intensity);
+        report.block(p->sparsity);
+        report.block(p->cc_learn);
+        report.block(p->tempo_bpm);
+        report.block(p->tempo_phase);
+        report.block(p->phrase_mode);
+        report.block(p->phrase_active);
+        report.block(p->map);
+        report.block(p->notify);
+        report.block(p->notifier);
+        report.block(p->tempo.period);
+        report.block(p->tempo.last_onset);
+        report.block(p->tempo.step_count);
+        report.block(p->tempo.steps_per_beat);
+        
+        report.trigger(p->chaos_x);
+        report.trigger(p->beat_count);
+        report.trigger(p->last_root);
+        report.trigger(p->active_notes);
+        report.trigger(p->bass_velocity);
+        report.trigger(p->bass_channel);
+        report.trigger(p->reggae_mode);
+        report.trigger(p->chaos_amount);
+        report.trigger(p->chaos_table);
+        report.trigger(p->tempo.prev_ioi);
+        report.trigger(p->tempo.hist_weight);
+        report.trigger(p->tempo.peak_bin);
+        report.trigger(p->tempo.hist[0]);  // One histogram bin per onset
+        
+        report.print("BassChaos");
+    }
+#endif
 };
 
 extern "C" {
 
 static LV2_Handle instantiate(const LV2_Descriptor* descriptor, double rate,
                              const char* bundle_path, const LV2_Feature* const* features) {
-    return new BassChaos(rate, features);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(BassChaos), sizeof(BassChaos)) != 0) return nullptr;
+    return new (memory) BassChaos(rate, features);
 }
 
 static void connect_port(LV2_Handle instance, uint32_t port, void* data) {
@@ -232,11 +528,30 @@ static void run(LV2_Handle instance, uint32_t n_samples) {
 }
 
 static void cleanup(LV2_Handle instance) {
-    if (instance) delete (BassChaos*)instance;
+    if (!instance) return;
+    ((BassChaos*)instance)->~BassChaos();
+    free(instance);
+}
+
+static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store,
+                             LV2_State_Handle handle, uint32_t flags,
+                             const LV2_Feature* const* features) {
+    return instance ? ((BassChaos*)instance)->saveState(store, handle) : LV2_STATE_ERR_UNKNOWN;
+}
+
+static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
+                                LV2_State_Handle handle, uint32_t flags,
+                                const LV2_Feature* const* features) {
+    return instance ? ((BassChaos*)instance)->restoreState(retrieve, handle) : LV2_STATE_ERR_UNKNOWN;
+}
+
+static const void* extension_data(const char* uri) {
+    static const LV2_State_Interface state = { save, restore };
+    return !strcmp(uri, LV2_STATE__interface) ? &state : nullptr;
 }
 
 static const LV2_Descriptor descriptor = {
-    BASS_CHAOS_URI, instantiate, connect_port, nullptr, run, nullptr, cleanup, nullptr
+    BASS_CHAOS_URI, instantiate, connect_port, nullptr, run, nullptr, cleanup, extension_data
 };
 
 LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
@@ -244,3 +559,10 @@ LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
 }
 
 }
+
+#ifdef CHAOS_FOOTPRINT
+int main() {
+    BassChaos::reportFootprint();
+    return 0;
+}
+#endif
@@ -4,10 +4,24 @@
 #include <lv2/atom/util.h>
 #include <lv2/atom/forge.h>
 #include <lv2/midi/midi.h>
+#include <lv2/state/state.h>
 #include <cmath>
 #include <cstring>
+#include <new>
 #include <stdlib.h>
 
+#include "cc_map.h"
+#include "chaos_table.h"
+#include "note_set.h"
+#include "output_budget.h"
+#include "state_notify.h"
+#include "tempo_tracker.h"
+#include "trace.h"
+
+#ifdef CHAOS_FOOTPRINT
+#include "footprint.h"
+#endif
+
 #define CHORD_CHAOS_URI "http://github.com/danja/midi-chord-chaos"
 
 enum PortIndex {
@@ -18,55 +32,89 @@ enum PortIndex {
     CHORD_VELOCITY  = 4,
     CHORD_CHANNEL   = 5,
     STRANGE_KEY_SHIFT = 6,
-    SPARSITY        = 7
+    SPARSITY        = 7,
+    CC_LEARN        = 8,
+    TEMPO_BPM       = 9,
+    TEMPO_PHASE     = 10,
+    NOTIFY          = 11,
+    CHAOS_AMOUNT    = 12
 };
 
 typedef struct {
     LV2_URID atom_Blank;
     LV2_URID atom_Sequence;
     LV2_URID midi_MidiEvent;
+    LV2_URID atom_Chunk;
+    LV2_URID state_ccMap;
 } URIDs;
 
-class ChordChaos {
+// Chord types (intervals from root), shared by every instance
+static const int8_t chord_types[8][4] = {
+    {0, 4, 7, -1},   // Major
+    {0, 3, 7, -1},   // Minor  
+    {0, 4, 7, 11},   // Maj7
+    {0, 3, 7, 10},   // Min7
+    {0, 4, 8, -1},   // Aug
+    {0, 3, 6, -1},   // Dim
+    {0, 4, 7, 10},   // Dom7
+    {0, 2, 7, -1}    // Sus2
+};
+
+// Pitch-class mask of a chord type, for recognising input chords
+static constexpr uint16_t chordMask(int a, int b, int c, int d) {
+    return (1 << a) | (1 << b) | (1 << c) | (d >= 0 ? 1 << (d % 12) : 0);
+}
+
+static const uint16_t chord_masks[8] = {
+    chordMask(0, 4, 7, -1), chordMask(0, 3, 7, -1), chordMask(0, 4, 7, 11), chordMask(0, 3, 7, 10),
+    chordMask(0, 4, 8, -1), chordMask(0, 3, 6, -1), chordMask(0, 4, 7, 10), chordMask(0, 2, 7, -1)
+};
+
+// Members are ordered hot first: what every block touches, then what a
+// chord trigger touches, then setup-only state
+class alignas(64) ChordChaos {
 private:
-    URIDs urids;
-    LV2_URID_Map* map;
-    
-    double chaos_x;
-    
-    // Chord types (intervals from root)
-    int chord_types[8][4] = {
-        {0, 4, 7, -1},   // Major
-        {0, 3, 7, -1},   // Minor  
-        {0, 4, 7, 11},   // Maj7
-        {0, 3, 7, 10},   // Min7
-        {0, 4, 8, -1},   // Aug
-        {0, 3, 6, -1},   // Dim
-        {0, 4, 7, 10},   // Dom7
-        {0, 2, 7, -1}    // Sus2
-    };
-    
-    // Ports
+    // Every block
     const LV2_Atom_Sequence* midi_in;
     LV2_Atom_Sequence* midi_out;
+    LV2_Atom_Forge forge;  // Initialised once, only the buffer changes per block
+    URIDs urids;
+    uint64_t sample_clock;
+    CCModulation cc;       // MIDI CC control of chaos parameters
     const float* chaos_k;
     const float* chaos_intensity;
+    const float* sparsity;
+    const float* cc_learn;
+    float* tempo_bpm;
+    float* tempo_phase;
+    
+    // Every chord
+    double chaos_x;
+    NoteSet active_chords;  // Active notes for chord off
+    uint32_t active_count;
+    int beat_count;         // Bar tracking for key shifts
+    int current_key_shift;
+    int previous_chord[4];  // Voice leading - track previous chord
+    int previous_chord_size;
+    bool first_chord;
     const float* chord_velocity;
     const float* chord_channel;
     const float* strange_key_shift;
-    const float* sparsity;
+    const float* chaos_amount;
+    const ChaosTable* chaos_table;  // Shared, built at the first instantiate
+    TempoTracker tempo;     // Tempo estimated from chord triggers
     
-    // Active notes for chord off
-    bool active_chords[128];
+    // Current chord and sounding notes for UIs
+    int last_chord_type;
+    int last_root;
+    LV2_Atom_Sequence* notify;
+    StateNotifier notifier;
     
-    // Voice leading - track previous chord
-    int previous_chord[4];
-    int previous_chord_size;
-    bool first_chord;
+    LV2_URID_Map* map;
     
-    // Bar tracking for key shifts
-    int beat_count;
-    int current_key_shift;
+#ifdef CHAOS_TRACE
+    TraceRing trace;
+#endif
     
     int calculateVoiceDistance(int* new_chord, int chord_size) {
         if (first_chord) return 0;
@@ -89,6 +137,7 @@ private:
     
     void optimizeVoiceLeading(int* chord_notes, int chord_size, uint8_t root) {
         if (chord_size <= 0 || chord_size > 4) return;
+        TRACE_SPAN(span, trace, TRACE_VOICE_LEADING);
         
         int best_arrangement[4];
         int best_distance = 999;
@@ -122,6 +171,8 @@ private:
             chord_notes[i] = best_arrangement[i];
         }
         
+        TRACE_ARGS(span, chord_size, best_distance);
+        
         // Store for next iteration
         previous_chord_size = (chord_size < 4) ? chord_size : 4;
         memcpy(previous_chord, chord_notes, previous_chord_size * sizeof(int));
@@ -129,8 +180,7 @@ private:
     }
     
     void generateChaos() {
-        double k = chaos_k ? *chaos_k : 3.8;
-        k = fmax(1.0, fmin(4.0, k)); // Clamp k
+        double k = fmax(1.0, fmin(4.0, getChaosK())); // Clamp k
         chaos_x = k * chaos_x * (1.0 - chaos_x);
         
         // Reset if chaos gets stuck or invalid
@@ -139,6 +189,13 @@ private:
         }
     }
     
+    float getChaosK() {
+        // Chaos Amount above zero takes over from the raw K
+        float amount = chaos_amount ? *chaos_amount : 0.0f;
+        if (amount > 0.0f) return chaos_table->kForAmount(amount);
+        return cc.get(CC_PARAM_CHAOS_K, chaos_k, 3.8f);
+    }
+    
     int selectChordType() {
         generateChaos();
         return (int)(chaos_x * 7.999); // Ensure < 8
@@ -154,7 +211,11 @@ private:
     }
     
     float getSparsity() {
-        return sparsity ? fmax(0.0f, fmin(1.0f, *sparsity)) : 0.0f;
+        return fmax(0.0f, fmin(1.0f, cc.get(CC_PARAM_SPARSITY, sparsity, 0.0f)));
+    }
+    
+    uint8_t getCCLearn() {
+        return cc_learn ? (uint8_t)fmax(0, fmin(CC_NUM_PARAMS - 1, *cc_learn)) : 0;
     }
     
     uint8_t getChordVelocity() {
@@ -183,16 +244,76 @@ private:
         }
     }
     
-    void writeChord(LV2_Atom_Forge* forge, uint32_t frames, uint8_t root, bool note_on) {
-        if (!forge) return;
+    // Find the chord type and root that best explain a set of input pitch
+    // classes: reward covered notes, penalise stray notes and unused tones
+    int detectChord(const uint8_t* notes, int n_notes, uint8_t* root) {
+        TRACE_SPAN(span, trace, TRACE_DETECT_CHORD);
+        uint16_t mask = 0;
+        uint8_t lowest = 127;
+        for (int i = 0; i < n_notes; i++) {
+            mask |= 1 << (notes[i] % 12);
+            if (notes[i] < lowest) lowest = notes[i];
+        }
+        
+        int best_type = 0;
+        int best_pc = lowest % 12;
+        int best_score = -999;
+        for (int pc = 0; pc < 12; pc++) {
+            for (int type = 0; type < 8; type++) {
+                uint16_t tmpl = ((chord_masks[type] << pc) | (chord_masks[type] >> (12 - pc))) & 0xFFF;
+                int score = 4 * __builtin_popcount(mask & tmpl)
+                          - 4 * __builtin_popcount(mask & ~tmpl)
+                          - __builtin_popcount(tmpl & ~mask);
+                if (pc == lowest % 12) score += 2; // Prefer root position
+                if (score > best_score) {
+                    best_score = score;
+                    best_type = type;
+                    best_pc = pc;
+                }
+            }
+        }
+        
+        // Root is the chord's pitch class at or below the lowest input note
+        int root_note = lowest - ((lowest % 12 - best_pc + 12) % 12);
+        *root = (uint8_t)(root_note < 0 ? root_note + 12 : root_note);
+        TRACE_ARGS(span, n_notes, best_type);
+        return best_type;
+    }
+    
+    // One chord per timestamp: a single note picks a chaotic chord type,
+    // several notes are harmonised as the chord they spell
+    void writeChordGroup(LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames,
+                         const uint8_t* notes, int n_notes) {
+        if (n_notes <= 0) return;
+        TRACE_SPAN(span, trace, TRACE_TRIGGER);
+        
+        // Update bar tracking for key shifts
+        updateBarTracking();
+        tempo.onset(sample_clock + frames);
+        
+        if (n_notes == 1) {
+            writeChord(forge, budget, frames, notes[0], -1, true);
+        } else {
+            uint8_t root;
+            int chord_type = detectChord(notes, n_notes, &root);
+            writeChord(forge, budget, frames, root, chord_type, true);
+        }
+        TRACE_ARGS(span, beat_count, active_count);
+    }
+    
+    void writeChord(LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames, uint8_t root,
+                    int chord_type, bool note_on) {
+        if (!forge || !budget) return;
         
         if (note_on) {
+            uint32_t allowance = budget->share(active_count);
+            
             // Check sparsity - maybe don't play anything
             float sparse_level = getSparsity();
             generateChaos();
             if (chaos_x < sparse_level) return; // Skip this chord
             
-            int chord_type = selectChordType();
+            if (chord_type < 0 || chord_type > 7) chord_type = selectChordType();
             int inversion = selectInversion();
             uint8_t channel = getChordChannel();
             uint8_t velocity = getChordVelocity();
@@ -222,12 +343,20 @@ private:
                 chord_size = (notes_to_play < chord_size) ? notes_to_play : chord_size;
             }
             
+            // Budget: each note also owes a note-off, and notes already
+            // sounding keep their note-offs reserved. Upper voices go first.
+            uint32_t max_notes = (allowance + 1) / 2;
+            if ((uint32_t)chord_size > max_notes) chord_size = (int)max_notes;
+            if (chord_size == 0) return;
+            
             // Optimize voice leading
             optimizeVoiceLeading(chord_notes, chord_size, root);
+            last_chord_type = chord_type;
+            last_root = root;
             
             // Output optimized chord
             for (int i = 0; i < chord_size; i++) {
-                if (chord_notes[i] >= 0 && chord_notes[i] <= 127) {
+                if (chord_notes[i] >= 0 && chord_notes[i] <= 127 && budget->take()) {
                     uint8_t midi_msg[3];
                     midi_msg[0] = 0x90 | (channel & 0x0F);
                     midi_msg[1] = chord_notes[i];
@@ -238,14 +367,16 @@ private:
                     lv2_atom_forge_raw(forge, midi_msg, 3);
                     lv2_atom_forge_pad(forge, 3);
                     
-                    active_chords[chord_notes[i]] = true;
+                    if (!active_chords.test(chord_notes[i])) active_count++;
+                    active_chords.set(chord_notes[i]);
                 }
             }
         } else {
             // Note off - stop active chord notes
             uint8_t channel = getChordChannel();
-            for (int i = 0; i < 128; i++) {
-                if (active_chords[i]) {
+            for (int i = active_chords.next(0); i >= 0; i = active_chords.next(i + 1)) {
+                // Notes that don't fit stay active and are released next time
+                if (budget->take()) {
                     uint8_t midi_msg[3] = {(uint8_t)(0x80 | (channel & 0x0F)), (uint8_t)i, 0};
                     
                     lv2_atom_forge_frame_time(forge, frames);
@@ -253,7 +384,8 @@ private:
                     lv2_atom_forge_raw(forge, midi_msg, 3);
                     lv2_atom_forge_pad(forge, 3);
                     
-                    active_chords[i] = false;
+                    active_chords.reset(i);
+                    active_count--;
                 }
             }
         }
@@ -270,8 +402,24 @@ public:
         chord_channel = nullptr;
         strange_key_shift = nullptr;
         sparsity = nullptr;
+        cc_learn = nullptr;
+        tempo_bpm = nullptr;
+        tempo_phase = nullptr;
+        notify = nullptr;
+        chaos_amount = nullptr;
+        chaos_table = &chaosTable();
+        last_chord_type = -1;
+        last_root = 0;
+        
+        cc.init();
+        tempo.init(rate, 1); // One chord per beat
+        sample_clock = 0;
         
-        memset(active_chords, 0, sizeof(active_chords));
+        active_chords.clear();
+        active_count = 0;
+#ifdef CHAOS_TRACE
+        trace.init();
+#endif
         
         // Initialize voice leading
         memset(previous_chord, 0, sizeof(previous_chord));
@@ -295,10 +443,23 @@ public:
             urids.atom_Blank = map->map(map->handle, LV2_ATOM__Blank);
             urids.atom_Sequence = map->map(map->handle, LV2_ATOM__Sequence);
             urids.midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+            urids.atom_Chunk = map->map(map->handle, LV2_ATOM__Chunk);
+            urids.state_ccMap = map->map(map->handle, CHORD_CHAOS_URI "#cc_map");
+            lv2_atom_forge_init(&forge, map);
+            notifier.init(map, CHORD_CHAOS_URI, rate, 4, true);
         }
     }
     
+#ifdef CHAOS_TRACE
+    ~ChordChaos() { trace.dump("chords"); }
+#endif
+    
     void connectPort(uint32_t port, void* data) {
+        // The notify port is optional and may be disconnected with NULL
+        if (port == NOTIFY) {
+            notify = (LV2_Atom_Sequence*)data;
+            return;
+        }
         if (!data) return;
         
         switch (port) {
@@ -310,47 +471,163 @@ public:
             case CHORD_CHANNEL: chord_channel = (const float*)data; break;
             case STRANGE_KEY_SHIFT: strange_key_shift = (const float*)data; break;
             case SPARSITY: sparsity = (const float*)data; break;
+            case CC_LEARN: cc_learn = (const float*)data; break;
+            case TEMPO_BPM: tempo_bpm = (float*)data; break;
+            case TEMPO_PHASE: tempo_phase = (float*)data; break;
+            case CHAOS_AMOUNT: chaos_amount = (const float*)data; break;
         }
     }
     
+    LV2_State_Status saveState(LV2_State_Store_Function store, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        return cc.save(store, handle, urids.state_ccMap, urids.atom_Chunk);
+    }
+    
+    LV2_State_Status restoreState(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        return cc.restore(retrieve, handle, urids.state_ccMap, urids.atom_Chunk);
+    }
+    
     void run(uint32_t n_samples) {
         if (!midi_in || !midi_out || !map) return;
+        TRACE_SPAN(run_span, trace, TRACE_RUN);
         
         const uint32_t out_capacity = midi_out->atom.size;
-        LV2_Atom_Forge forge;
-        lv2_atom_forge_init(&forge, map);
         lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_out, out_capacity);
         
         LV2_Atom_Forge_Frame seq_frame;
         lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
         
+        OutputBudget budget;
+        budget.init(out_capacity, countNoteOnGroups(midi_in, urids.midi_MidiEvent));
+        
+        // Control ports moved by the host take over from earlier CCs
+        cc.sync(CC_PARAM_CHAOS_K, chaos_k);
+        cc.sync(CC_PARAM_CHAOS_INTENSITY, chaos_intensity);
+        cc.sync(CC_PARAM_SPARSITY, sparsity);
+        uint8_t learn_param = getCCLearn();
+        
+        // Note-ons sharing a timestamp are collected and harmonised once
+        uint8_t group_notes[16];
+        int group_size = 0;
+        uint32_t group_frames = 0;
+        
         LV2_ATOM_SEQUENCE_FOREACH(midi_in, ev) {
             if (ev->body.type == urids.midi_MidiEvent) {
                 const uint8_t* const msg = (const uint8_t*)(ev + 1);
+                const uint32_t frames = ev->time.frames;
                 
-                if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
-                    // Update bar tracking for key shifts
-                    updateBarTracking();
+                if ((msg[0] & 0xF0) == 0xB0) {
+                    // Pending chord is generated with the values before this CC
+                    writeChordGroup(&forge, &budget, group_frames, group_notes, group_size);
+                    group_size = 0;
                     
-                    // Note on - generate chord
-                    writeChord(&forge, ev->time.frames, msg[1], true);
+                    // CC modulation takes effect from this frame on
+                    cc.controlChange(msg[1], msg[2], learn_param);
+                }
+                else if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
+                    // Note on - start a new group when the timestamp moves on
+                    if (group_size > 0 && frames != group_frames) {
+                        writeChordGroup(&forge, &budget, group_frames, group_notes, group_size);
+                        group_size = 0;
+                    }
+                    group_frames = frames;
+                    if (group_size < 16) group_notes[group_size++] = msg[1];
                 }
                 else if ((msg[0] & 0xF0) == 0x80 || ((msg[0] & 0xF0) == 0x90 && msg[2] == 0)) {
+                    // Pending chord sounds before the note-off that follows it
+                    writeChordGroup(&forge, &budget, group_frames, group_notes, group_size);
+                    group_size = 0;
+                    
                     // Note off - stop active chord notes
-                    writeChord(&forge, ev->time.frames, msg[1], false);
+                    writeChord(&forge, &budget, frames, msg[1], -1, false);
                 }
             }
         }
+        writeChordGroup(&forge, &budget, group_frames, group_notes, group_size);
         
         lv2_atom_forge_pop(&forge, &seq_frame);
+        
+        if (notify) {
+            TRACE_SPAN(span, trace, TRACE_NOTIFY);
+            // Lanes are the sounding notes, 32 per word
+            StateSnapshot snapshot = {};
+            snapshot.step = beat_count;
+            snapshot.chord = last_chord_type;
+            snapshot.root = last_root;
+            snapshot.chaos = (float)chaos_x;
+            memcpy(snapshot.lanes, active_chords.bits, sizeof(active_chords.bits));
+            bool published = notifier.run(notify, sample_clock, n_samples ? n_samples - 1 : 0, snapshot);
+            TRACE_ARGS(span, published, 0);
+            (void)published;
+        }
+        
+        sample_clock += n_samples;
+        if (tempo_bpm) *tempo_bpm = tempo.bpm();
+        if (tempo_phase) *tempo_phase = tempo.phase(sample_clock);
+        TRACE_ARGS(run_span, traceCountEvents(midi_in), traceCountEvents(midi_out));
+    }
+    
+#ifdef CHAOS_FOOTPRINT
+    // Mark the members run() reads and writes, per block and per chord
+    static void reportFootprint() {
+        ChordChaos instance(48000.0, nullptr);
+        ChordChaos* p = &instance;
+        FootprintReport report(p, sizeof(ChordChaos));
+        report.shared(chord_types);
+        report.shared(chord_masks);
+        report.shared(chaosTable());
+        
+        report.block(p->midi_in);
+        report.block(p->midi_out);
+        report.block(p->forge);
+        report.block(p->urids);
+        report.block(p->sample_clock);
+        report.block(p->cc.params);
+        report.block(p->chaos_k);
+        report.block(p->chaos_intensity);
+        report.block(p->sparsity);
+        report.block(p->cc_learn);
+        report.block(p->tempo_bpm);
+        report.block(p->tempo_phase);
+        report.block(p->map);
+        report.block(p->notify);
+        report.block(p->notifier);
+        report.block(p->tempo.period);
+        report.block(p->tempo.last_onset);
+        report.block(p->tempo.step_count);
+        report.block(p->tempo.steps_per_beat);
+        
+        report.trigger(p->chaos_x);
+        report.trigger(p->active_chords);
+        report.trigger(p->active_count);
+        report.trigger(p->beat_count);
+        report.trigger(p->current_key_shift);
+        report.trigger(p->previous_chord);
+        report.trigger(p->previous_chord_size);
+        report.trigger(p->first_chord);
+        report.trigger(p->chord_velocity);
+        report.trigger(p->chord_channel);
+        report.trigger(p->strange_key_shift);
+        report.trigger(p->chaos_amount);
+        report.trigger(p->chaos_table);
+        report.trigger(p->tempo.prev_ioi);
+        report.trigger(p->tempo.hist_weight);
+        report.trigger(p->tempo.peak_bin);
+        report.trigger(p->tempo.hist[0]);  // One histogram bin per onset
+        
+        report.print("ChordChaos");
     }
+#endif
 };
 
 extern "C" {
 
 static LV2_Handle instantiate(const LV2_Descriptor* descriptor, double rate,
                              const char* bundle_path, const LV2_Feature* const* features) {
-    return new ChordChaos(rate, features);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(ChordChaos), sizeof(ChordChaos)) != 0) return nullptr;
+    return new (memory) ChordChaos(rate, features);
 }
 
 static void connect_port(LV2_Handle instance, uint32_t port, void* data) {
@@ -362,11 +639,30 @@ static void run(LV2_Handle instance, uint32_t n_samples) {
 }
 
 static void cleanup(LV2_Handle instance) {
-    if (instance) delete (ChordChaos*)instance;
+    if (!instance) return;
+    ((ChordChaos*)instance)->~ChordChaos();
+    free(instance);
+}
+
+static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store,
+                             LV2_State_Handle handle, uint32_t flags,
+                             const LV2_Feature* const* features) {
+    return instance ? ((ChordChaos*)instance)->saveState(store, handle) : LV2_STATE_ERR_UNKNOWN;
+}
+
+static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
+                                LV2_State_Handle handle, uint32_t flags,
+                                const LV2_Feature* const* features) {
+    return instance ? ((ChordChaos*)instance)->restoreState(retrieve, handle) : LV2_STATE_ERR_UNKNOWN;
+}
+
+static const void* extension_data(const char* uri) {
+    static const LV2_State_Interface state = { save, restore };
+    return !strcmp(uri, LV2_STATE__interface) ? &state : nullptr;
 }
 
 static const LV2_Descriptor descriptor = {
-    CHORD_CHAOS_URI, instantiate, connect_port, nullptr, run, nullptr, cleanup, nullptr
+    CHORD_CHAOS_URI, instantiate, connect_port, nullptr, run, nullptr, cleanup, extension_data
 };
 
 LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
@@ -374,3 +670,10 @@ LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
 }
 
 }
+
+#ifdef CHAOS_FOOTPRINT
+int main() {
+    ChordChaos::reportFootprint();
+    return 0;
+}
+#endif
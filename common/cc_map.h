@@ -0,0 +1,141 @@
+#ifndef CHAOS_CC_MAP_H
+#define CHAOS_CC_MAP_H
+
+#include <lv2/state/state.h>
+#include <lv2/urid/urid.h>
+#include <stdint.h>
+#include <string.h>
+
+// Parameters that can be driven by MIDI CC. The numbering is shared by all
+// three plugins so a saved map means the same thing everywhere.
+enum CCParam {
+    CC_PARAM_NONE            = 0,
+    CC_PARAM_CHAOS_K         = 1,
+    CC_PARAM_CHAOS_INTENSITY = 2,
+    CC_PARAM_SPARSITY        = 3,
+    CC_NUM_PARAMS            = 4
+};
+
+static const uint8_t CC_UNBOUND = 0xFF;
+
+// CC number <-> parameter table. Both directions are kept so binding a
+// controller and dispatching a CC are single lookups.
+struct CCMap {
+    uint8_t param[128];              // Controller -> CCParam
+    uint8_t controller[CC_NUM_PARAMS]; // CCParam -> controller, CC_UNBOUND if none
+
+    void clear() {
+        memset(param, CC_PARAM_NONE, sizeof(param));
+        memset(controller, CC_UNBOUND, sizeof(controller));
+    }
+
+    void setDefaults() {
+        // General purpose controllers 20-22 so the map works before any learning
+        clear();
+        bind(20, CC_PARAM_CHAOS_K);
+        bind(21, CC_PARAM_CHAOS_INTENSITY);
+        bind(22, CC_PARAM_SPARSITY);
+    }
+
+    // One controller per parameter and one parameter per controller
+    void bind(uint8_t cc, uint8_t p) {
+        if (cc > 127 || p == CC_PARAM_NONE || p >= CC_NUM_PARAMS) return;
+        if (controller[p] != CC_UNBOUND) param[controller[p]] = CC_PARAM_NONE;
+        if (param[cc] != CC_PARAM_NONE) controller[param[cc]] = CC_UNBOUND;
+        param[cc] = p;
+        controller[p] = cc;
+    }
+
+    uint8_t lookup(uint8_t cc) const { return param[cc & 0x7F]; }
+
+    // Rebuild from the persisted controller -> parameter table
+    bool load(const uint8_t* data, size_t size) {
+        if (!data || size != sizeof(param)) return false;
+        clear();
+        for (uint8_t cc = 0; cc < 128; cc++) bind(cc, data[cc]);
+        return true;
+    }
+};
+
+// A parameter that follows its control port until a CC moves it. When the
+// host changes the port again the port takes over.
+struct ModulatedParam {
+    float minimum;
+    float maximum;
+    float port_value;  // Port value seen at the last sync
+    float cc_value;
+    bool cc_active;
+
+    void init(float lo, float hi) {
+        minimum = lo;
+        maximum = hi;
+        port_value = 0.0f;
+        cc_value = lo;
+        cc_active = false;
+    }
+
+    void sync(const float* port) {
+        if (port && *port != port_value) {
+            port_value = *port;
+            cc_active = false;
+        }
+    }
+
+    void setFromCC(uint8_t value) {
+        cc_value = minimum + (maximum - minimum) * (value & 0x7F) / 127.0f;
+        cc_active = true;
+    }
+
+    float get(const float* port, float fallback) const {
+        if (cc_active) return cc_value;
+        return port ? *port : fallback;
+    }
+};
+
+// CC map plus the modulated parameters it drives. Plugins sync the ports
+// once per block and feed CCs in event order, so a change lands on the
+// exact frame of its CC. Nothing runs while no CCs arrive.
+struct CCModulation {
+    ModulatedParam params[CC_NUM_PARAMS];  // Read every block, kept first
+    CCMap map;                             // Only read when a CC arrives
+
+    void init() {
+        map.setDefaults();
+        params[CC_PARAM_NONE].init(0.0f, 0.0f);
+        params[CC_PARAM_CHAOS_K].init(1.0f, 4.0f);
+        params[CC_PARAM_CHAOS_INTENSITY].init(0.0f, 1.0f);
+        params[CC_PARAM_SPARSITY].init(0.0f, 1.0f);
+    }
+
+    void sync(int p, const float* port) { params[p].sync(port); }
+
+    float get(int p, const float* port, float fallback) const {
+        return params[p].get(port, fallback);
+    }
+
+    // learn_param binds this controller first when CC learn is on
+    void controlChange(uint8_t cc, uint8_t value, uint8_t learn_param) {
+        if (learn_param != CC_PARAM_NONE) map.bind(cc, learn_param);
+        uint8_t p = map.lookup(cc);
+        if (p != CC_PARAM_NONE) params[p].setFromCC(value);
+    }
+
+    LV2_State_Status save(LV2_State_Store_Function store, LV2_State_Handle handle,
+                          LV2_URID key, LV2_URID chunk_type) const {
+        return store(handle, key, map.param, sizeof(map.param), chunk_type,
+                     LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+    }
+
+    LV2_State_Status restore(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle,
+                             LV2_URID key, LV2_URID chunk_type) {
+        size_t size = 0;
+        uint32_t type = 0;
+        uint32_t flags = 0;
+        const void* data = retrieve(handle, key, &size, &type, &flags);
+        if (!data) return LV2_STATE_SUCCESS; // Keep the defaults
+        if (type != chunk_type) return LV2_STATE_ERR_BAD_TYPE;
+        return map.load((const uint8_t*)data, size) ? LV2_STATE_SUCCESS : LV2_STATE_ERR_UNKNOWN;
+    }
+};
+
+#endif // CHAOS_CC_MAP_H
@@ -0,0 +1,107 @@
+#ifndef CHAOS_CHAOS_TABLE_H
+#define CHAOS_CHAOS_TABLE_H
+
+#include <cmath>
+#include <stdint.h>
+
+// Behaviour of the logistic map x -> k x (1 - x) sampled over k = 1..4,
+// and a "chaos amount" scale built from it. Raw k is very uneven: most of
+// the range settles to a fixed point or a short cycle, and periodic windows
+// inside the chaotic range (period 3 near 3.83) freeze the output. The
+// amount scale spends its first part on the period-doubling cascade and
+// the rest rises linearly in Lyapunov exponent over chaotic k only, so
+// windows are never selected. Built once per process, lookups are O(1).
+struct ChaosTable {
+    static const int K_STEPS = 1024;
+    static const int AMOUNT_STEPS = 256;
+    static constexpr double K_MIN = 1.0;
+    static constexpr double K_MAX = 4.0;
+    static constexpr double K_CASCADE = 2.9;      // Where period doubling starts to matter
+    static constexpr double K_ONSET = 3.5699;     // Accumulation point, chaos begins
+    static constexpr float CASCADE_SHARE = 0.2f;  // Part of the amount scale before chaos
+    static constexpr float LAMBDA_MIN = 0.15f;    // Below this chaos is riddled with windows
+    static const int MAX_PERIOD = 64;
+
+    float lyapunov[K_STEPS];  // Lyapunov exponent at each sampled k
+    uint8_t period[K_STEPS];  // Cycle length, 0 when chaotic
+    float amount_k[AMOUNT_STEPS];
+
+    static double kAt(int i) { return K_MIN + (K_MAX - K_MIN) * i / (K_STEPS - 1); }
+
+    ChaosTable() {
+        for (int i = 0; i < K_STEPS; i++) measure(i);
+
+        // Cascade part: linear in k up to the onset of chaos
+        int cascade_steps = (int)(CASCADE_SHARE * (AMOUNT_STEPS - 1));
+        for (int a = 0; a <= cascade_steps; a++) {
+            amount_k[a] = (float)(K_CASCADE + (K_ONSET - K_CASCADE) * a / cascade_steps);
+        }
+
+        // Chaotic part: linear in Lyapunov exponent. The first k reaching
+        // each target is taken, with chaotic neighbours so a window edge is
+        // never chosen; later targets can only move k upwards. k = 4 itself
+        // is left out: it sends x = 0.5 to 1 and then 0 and stays there.
+        const int last = K_STEPS - 2;
+        float lambda_max = LAMBDA_MIN;
+        for (int i = 0; i <= last; i++) {
+            if (lyapunov[i] > lambda_max) lambda_max = lyapunov[i];
+        }
+        int onset = (int)ceil((K_ONSET - K_MIN) / (K_MAX - K_MIN) * (K_STEPS - 1));
+        int j = onset;
+        for (int a = cascade_steps + 1; a < AMOUNT_STEPS; a++) {
+            float t = (float)(a - cascade_steps) / (AMOUNT_STEPS - 1 - cascade_steps);
+            float target = LAMBDA_MIN + t * (lambda_max - LAMBDA_MIN);
+            while (j < last && !(lyapunov[j] >= target && chaotic(j - 1) && chaotic(j + 1))) j++;
+            amount_k[a] = (float)kAt(j);
+        }
+    }
+
+    bool chaotic(int i) const {
+        if (i < 0 || i >= K_STEPS) return true;  // Range ends count as chaotic neighbours
+        return period[i] == 0 && lyapunov[i] > 0.0f;
+    }
+
+    void measure(int i) {
+        const double k = kAt(i);
+        double x = 0.3;
+        for (int n = 0; n < 1000; n++) x = k * x * (1.0 - x);  // Settle onto the attractor
+
+        // Smallest p with x returning to itself, if any
+        const double x0 = x;
+        period[i] = 0;
+        for (int p = 1; p <= MAX_PERIOD; p++) {
+            x = k * x * (1.0 - x);
+            if (fabs(x - x0) < 1e-7) {
+                period[i] = (uint8_t)p;
+                break;
+            }
+        }
+
+        // Mean log of the map's slope along the orbit
+        double sum = 0.0;
+        const int n_measure = 2000;
+        for (int n = 0; n < n_measure; n++) {
+            double slope = fabs(k * (1.0 - 2.0 * x));
+            sum += log(slope > 1e-12 ? slope : 1e-12);
+            x = k * x * (1.0 - x);
+        }
+        lyapunov[i] = (float)(sum / n_measure);
+    }
+
+    // k for an amount in 0-1
+    float kForAmount(float amount) const {
+        if (!(amount > 0.0f)) return amount_k[0];
+        if (amount >= 1.0f) return amount_k[AMOUNT_STEPS - 1];
+        return amount_k[(int)(amount * (AMOUNT_STEPS - 1) + 0.5f)];
+    }
+};
+
+// Shared by every instance in the process. The first call builds the table,
+// about 3 million map iterations (20-40 ms at -O3), so plugins call this
+// from instantiate, never first from run().
+static inline const ChaosTable& chaosTable() {
+    static const ChaosTable table;
+    return table;
+}
+
+#endif // CHAOS_CHAOS_TABLE_H
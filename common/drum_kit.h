@@ -0,0 +1,94 @@
+#ifndef CHAOS_DRUM_KIT_H
+#define CHAOS_DRUM_KIT_H
+
+#include <lv2/state/state.h>
+#include <lv2/urid/urid.h>
+#include <stdint.h>
+#include <string.h>
+
+// Input and output note per drum lane, with the output channel per lane,
+// for samplers that do not follow the GM drum map. Incoming notes are
+// dispatched through a 128-entry note -> lane table that is only rebuilt
+// when the mapping changes.
+struct DrumKit {
+    static const int LANES = 7;
+    static const uint8_t NO_LANE = 0xFF;
+
+    uint8_t lane_of[128];       // Input note -> lane, NO_LANE if unmapped
+    uint8_t in_note[LANES];
+    uint8_t out_note[LANES];
+    uint8_t out_channel[LANES]; // 0-based
+    uint8_t in_channel;         // Channel learn mode listens on, 0-based
+
+    void setDefaults(const uint8_t* notes, uint8_t channel) {
+        memcpy(in_note, notes, LANES);
+        memcpy(out_note, notes, LANES);
+        memset(out_channel, channel, LANES);
+        in_channel = channel;
+        rebuild();
+    }
+
+    // Lower lanes win when two share an input note
+    void rebuild() {
+        memset(lane_of, NO_LANE, sizeof(lane_of));
+        for (int lane = LANES - 1; lane >= 0; lane--) lane_of[in_note[lane]] = (uint8_t)lane;
+    }
+
+    int lane(uint8_t note) const {
+        uint8_t l = lane_of[note & 0x7F];
+        return (l == NO_LANE) ? -1 : l;
+    }
+
+    // Learned from a note-on; returns whether the mapping changed
+    bool learnInput(int lane, uint8_t note, uint8_t channel) {
+        if (lane < 0 || lane >= LANES) return false;
+        note &= 0x7F;
+        channel &= 0x0F;
+        if (in_note[lane] == note && in_channel == channel) return false;
+        in_note[lane] = note;
+        in_channel = channel;
+        rebuild();
+        return true;
+    }
+
+    void learnOutput(int lane, uint8_t note, uint8_t channel) {
+        if (lane < 0 || lane >= LANES) return;
+        out_note[lane] = note & 0x7F;
+        out_channel[lane] = channel & 0x0F;
+    }
+
+    // Persisted as in_note, out_note, out_channel, in_channel
+    static const size_t STATE_SIZE = 3 * LANES + 1;
+
+    LV2_State_Status save(LV2_State_Store_Function store, LV2_State_Handle handle,
+                          LV2_URID key, LV2_URID chunk_type) const {
+        uint8_t data[STATE_SIZE];
+        memcpy(data, in_note, LANES);
+        memcpy(data + LANES, out_note, LANES);
+        memcpy(data + 2 * LANES, out_channel, LANES);
+        data[3 * LANES] = in_channel;
+        return store(handle, key, data, sizeof(data), chunk_type,
+                     LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+    }
+
+    LV2_State_Status restore(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle,
+                             LV2_URID key, LV2_URID chunk_type) {
+        size_t size = 0;
+        uint32_t type = 0;
+        uint32_t flags = 0;
+        const uint8_t* data = (const uint8_t*)retrieve(handle, key, &size, &type, &flags);
+        if (!data) return LV2_STATE_SUCCESS; // Keep the defaults
+        if (type != chunk_type) return LV2_STATE_ERR_BAD_TYPE;
+        if (size != STATE_SIZE) return LV2_STATE_ERR_UNKNOWN;
+        for (int lane = 0; lane < LANES; lane++) {
+            in_note[lane] = data[lane] & 0x7F;
+            out_note[lane] = data[LANES + lane] & 0x7F;
+            out_channel[lane] = data[2 * LANES + lane] & 0x0F;
+        }
+        in_channel = data[3 * LANES] & 0x0F;
+        rebuild();
+        return LV2_STATE_SUCCESS;
+    }
+};
+
+#endif // CHAOS_DRUM_KIT_H
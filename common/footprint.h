@@ -0,0 +1,66 @@
+#ifndef CHAOS_FOOTPRINT_H
+#define CHAOS_FOOTPRINT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Memory footprint report for `make footprint`: bytes per instance and
+// any blocks it allocates, the cache lines that make up an instance and the
+// lines a run() touches, worked out from the addresses of the members the
+// hot path uses.
+struct FootprintReport {
+    static const size_t LINE = 64;
+    static const size_t MAX_LINES = 512;
+
+    const char* base;
+    size_t instance_size;
+    size_t shared_bytes;
+    size_t allocated_bytes;
+    const char* allocated_when;
+    bool block_lines[MAX_LINES];    // Touched by every run()
+    bool trigger_lines[MAX_LINES];  // Touched by a trigger on top of that
+
+    FootprintReport(const void* instance, size_t size)
+        : base((const char*)instance), instance_size(size), shared_bytes(0), allocated_bytes(0), allocated_when("") {
+        memset(block_lines, 0, sizeof(block_lines));
+        memset(trigger_lines, 0, sizeof(trigger_lines));
+    }
+
+    void mark(bool* lines, const void* member, size_t size) {
+        size_t offset = (const char*)member - base;
+        for (size_t line = offset / LINE; line <= (offset + size - 1) / LINE && line < MAX_LINES; line++) {
+            lines[line] = true;
+        }
+    }
+
+    template <typename T> void block(const T& member) { mark(block_lines, &member, sizeof(T)); }
+    template <typename T> void trigger(const T& member) { mark(trigger_lines, &member, sizeof(T)); }
+    template <typename T> void shared(const T& table) { shared_bytes += sizeof(T); }
+    template <typename T> void allocated(const T& block, const char* when) {
+        allocated_bytes += sizeof(T);
+        allocated_when = when;
+    }
+
+    static size_t count(const bool* lines) {
+        size_t n = 0;
+        for (size_t i = 0; i < MAX_LINES; i++) n += lines[i];
+        return n;
+    }
+
+    void print(const char* name) {
+        size_t with_trigger = 0;
+        for (size_t i = 0; i < MAX_LINES; i++) with_trigger += block_lines[i] || trigger_lines[i];
+        printf("%s\n", name);
+        printf("  instance:           %zu bytes, %zu cache lines\n",
+               instance_size, (instance_size + LINE - 1) / LINE);
+        if (allocated_bytes) {
+            printf("  allocated:          %zu bytes (per instance, %s)\n", allocated_bytes, allocated_when);
+        }
+        printf("  shared tables:      %zu bytes (read-only, one copy per process)\n", shared_bytes);
+        printf("  run() touches:      %zu lines\n", count(block_lines));
+        printf("  run() with trigger: %zu lines\n", with_trigger);
+    }
+};
+
+#endif // CHAOS_FOOTPRINT_H
@@ -0,0 +1,68 @@
+#ifndef CHAOS_NOTE_QUEUE_H
+#define CHAOS_NOTE_QUEUE_H
+
+#include <stdint.h>
+
+// MIDI events scheduled for a later frame, possibly in a later block.
+// Fixed capacity, no allocation: events are kept sorted latest first, so
+// the next one due is at the end and taking it is O(1). Inserting shifts
+// only the events due before the new one. Times are the low 32 bits of the
+// absolute sample time and compared wrap-safe, which holds while nothing
+// is scheduled more than 2^31 samples ahead; an event is 8 bytes. A tag
+// byte lets the owner take back events it queued ahead of time.
+struct NoteQueue {
+    static const int CAPACITY = 64;
+
+    struct Event {
+        uint32_t time;
+        uint8_t msg[3];
+        uint8_t tag;  // 0 for events that are never taken back
+    };
+
+    static bool before(uint32_t a, uint32_t b) { return (int32_t)(a - b) <= 0; }
+
+    int count;
+    Event events[CAPACITY];
+
+    void clear() { count = 0; }
+    bool empty() const { return count == 0; }
+    int room() const { return CAPACITY - count; }
+
+    // Returns false and drops the event when the queue is full
+    bool push(uint64_t time, uint8_t status, uint8_t note, uint8_t velocity, uint8_t tag = 0) {
+        if (count >= CAPACITY) return false;
+        int i = count++;
+        // Equal times keep their insertion order
+        while (i > 0 && before(events[i - 1].time, (uint32_t)time)) {
+            events[i] = events[i - 1];
+            i--;
+        }
+        events[i].time = (uint32_t)time;
+        events[i].msg[0] = status;
+        events[i].msg[1] = note;
+        events[i].msg[2] = velocity;
+        events[i].tag = tag;
+        return true;
+    }
+
+    // Drop the events carrying `tag`, keeping the order of the rest.
+    // Returns how many were dropped.
+    int removeTagged(uint8_t tag) {
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (events[i].tag != tag) events[kept++] = events[i];
+        }
+        int removed = count - kept;
+        count = kept;
+        return removed;
+    }
+
+    // The next event if it is due by `until`, else nullptr
+    const Event* due(uint64_t until) const {
+        return (count && before(events[count - 1].time, (uint32_t)until)) ? &events[count - 1] : nullptr;
+    }
+
+    void pop() { if (count) count--; }
+};
+
+#endif // CHAOS_NOTE_QUEUE_H
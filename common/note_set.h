@@ -0,0 +1,31 @@
+#ifndef CHAOS_NOTE_SET_H
+#define CHAOS_NOTE_SET_H
+
+#include <stdint.h>
+
+// Set of MIDI notes as a 128-bit mask: 16 bytes instead of bool[128], and
+// walking the sounding notes skips empty words
+struct NoteSet {
+    uint32_t bits[4];
+
+    void clear() { bits[0] = bits[1] = bits[2] = bits[3] = 0; }
+    bool test(uint8_t note) const { return (bits[(note >> 5) & 3] >> (note & 31)) & 1; }
+    void set(uint8_t note) { bits[(note >> 5) & 3] |= 1u << (note & 31); }
+    void reset(uint8_t note) { bits[(note >> 5) & 3] &= ~(1u << (note & 31)); }
+    int count() const {
+        return __builtin_popcount(bits[0]) + __builtin_popcount(bits[1]) +
+               __builtin_popcount(bits[2]) + __builtin_popcount(bits[3]);
+    }
+
+    // Lowest note at or above `from` (0-128), or -1
+    int next(int from) const {
+        for (int word = from >> 5; word < 4; word++) {
+            uint32_t w = bits[word];
+            if (word == (from >> 5)) w &= ~0u << (from & 31);
+            if (w) return (word << 5) + __builtin_ctz(w);
+        }
+        return -1;
+    }
+};
+
+#endif // CHAOS_NOTE_SET_H
@@ -0,0 +1,77 @@
+#ifndef CHAOS_OUTPUT_BUDGET_H
+#define CHAOS_OUTPUT_BUDGET_H
+
+#include <lv2/atom/atom.h>
+#include <lv2/atom/util.h>
+#include <stdint.h>
+
+// Bytes one 3-byte MIDI event takes in an atom sequence (event header + padded body)
+static const uint32_t MIDI_EVENT_BYTES = sizeof(LV2_Atom_Event) + 8;
+
+// Count note-ons in the input so the output budget can be shared out before
+// any generation happens. Only event headers are touched.
+static inline uint32_t countNoteOns(const LV2_Atom_Sequence* seq, LV2_URID midi_type) {
+    uint32_t count = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(seq, ev) {
+        if (ev->body.type == midi_type && ev->body.size >= 3) {
+            const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) count++;
+        }
+    }
+    return count;
+}
+
+// Count groups of note-ons, for plugins that treat all note-ons at one
+// timestamp as a single trigger. A CC or note-off closes the open group
+// even within a frame, so on/CC/on at one timestamp counts as two.
+static inline uint32_t countNoteOnGroups(const LV2_Atom_Sequence* seq, LV2_URID midi_type) {
+    uint32_t count = 0;
+    bool open = false;
+    int64_t group_frames = -1;
+    LV2_ATOM_SEQUENCE_FOREACH(seq, ev) {
+        if (ev->body.type == midi_type && ev->body.size >= 1) {
+            const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            const uint8_t status = msg[0] & 0xF0;
+            if (status == 0x90 && ev->body.size >= 3 && msg[2] > 0) {
+                if (!open || ev->time.frames != group_frames) count++;
+                open = true;
+                group_frames = ev->time.frames;
+            } else if (status == 0xB0 || status == 0x80 || status == 0x90) {
+                open = false;
+            }
+        }
+    }
+    return count;
+}
+
+// Per-block output event budget. Each trigger gets a fair share of what is
+// left, so under dense input every trigger still plays its most important
+// notes instead of the last triggers in the block losing everything.
+struct OutputBudget {
+    uint32_t remaining;  // MIDI events that still fit in the output buffer
+    uint32_t triggers;   // Triggers not yet served this block
+
+    void init(uint32_t capacity_bytes, uint32_t n_triggers) {
+        const uint32_t header = sizeof(LV2_Atom_Sequence);
+        remaining = (capacity_bytes > header) ? (capacity_bytes - header) / MIDI_EVENT_BYTES : 0;
+        triggers = n_triggers;
+    }
+
+    // Notes the next trigger may emit, keeping `reserved` events back
+    // (e.g. note-offs owed for notes already sounding)
+    uint32_t share(uint32_t reserved) {
+        uint32_t free_events = (remaining > reserved) ? remaining - reserved : 0;
+        uint32_t pending = triggers ? triggers : 1;
+        if (triggers) triggers--;
+        // Round up so early triggers still get their top-priority note
+        return (free_events + pending - 1) / pending;
+    }
+
+    bool take() {
+        if (!remaining) return false;
+        remaining--;
+        return true;
+    }
+};
+
+#endif // CHAOS_OUTPUT_BUDGET_H
@@ -0,0 +1,139 @@
+#ifndef CHAOS_STATE_NOTIFY_H
+#define CHAOS_STATE_NOTIFY_H
+
+#include <lv2/atom/atom.h>
+#include <lv2/atom/forge.h>
+#include <lv2/urid/urid.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// What a plugin shows on its notify port. `lanes` are bit words whose
+// meaning depends on the plugin (drum lane patterns, sounding notes).
+struct StateSnapshot {
+    static const int MAX_LANES = 16;
+
+    uint32_t step;
+    int32_t chord;   // Chord type, -1 when the plugin has none
+    int32_t root;
+    float chaos;
+    uint32_t lanes[MAX_LANES];
+};
+
+// Publishes state deltas on an atom notify port for UIs and monitors.
+// At most one object per block, no closer together than min_interval
+// samples, and nothing at all while the state does not change. Only lanes
+// that changed since the last published object are sent:
+//
+//   [ a <plugin>#State ;
+//     <plugin>#step 5 ;
+//     <plugin>#changed 0x3 ;              # Bit per lane in lanes
+//     <plugin>#lanes [ 0x0241 , 0x5010 ] ; # Changed lanes only, in order
+//     <plugin>#chord 2 ; <plugin>#root 60 ; # Chord plugin only
+//     <plugin>#chaos 0.71 ]
+struct StateNotifier {
+    static const uint32_t MAX_OBJECT_BYTES = 320;  // Largest delta object with its event header
+
+    LV2_Atom_Forge forge;
+    LV2_URID State;
+    LV2_URID step;
+    LV2_URID changed;
+    LV2_URID lanes;
+    LV2_URID chord;
+    LV2_URID root;
+    LV2_URID chaos;
+
+    StateSnapshot published;
+    uint64_t last_publish;  // Sample time of the last object
+    uint32_t min_interval;
+    int n_lanes;
+    bool has_chord;
+    bool has_published;
+
+    static LV2_URID mapProperty(LV2_URID_Map* map, const char* plugin_uri, const char* name) {
+        char uri[256];
+        snprintf(uri, sizeof(uri), "%s#%s", plugin_uri, name);
+        return map->map(map->handle, uri);
+    }
+
+    // Called from instantiate: maps URIDs, nothing here runs in run()
+    void init(LV2_URID_Map* map, const char* plugin_uri, double rate, int lane_count, bool chord_info) {
+        lv2_atom_forge_init(&forge, map);
+        State = mapProperty(map, plugin_uri, "State");
+        step = mapProperty(map, plugin_uri, "step");
+        changed = mapProperty(map, plugin_uri, "changed");
+        lanes = mapProperty(map, plugin_uri, "lanes");
+        chord = mapProperty(map, plugin_uri, "chord");
+        root = mapProperty(map, plugin_uri, "root");
+        chaos = mapProperty(map, plugin_uri, "chaos");
+
+        memset(&published, 0, sizeof(published));
+        last_publish = 0;
+        min_interval = (uint32_t)(rate / 30.0);  // ~30 updates per second
+        n_lanes = (lane_count < StateSnapshot::MAX_LANES) ? lane_count : StateSnapshot::MAX_LANES;
+        has_chord = chord_info;
+        has_published = false;
+    }
+
+    // Write this block's notify sequence: empty, or one delta object at
+    // `frames`. `now` is the absolute sample time at the start of the block.
+    // Returns whether an object was published.
+    bool run(LV2_Atom_Sequence* port, uint64_t now, uint32_t frames, const StateSnapshot& s) {
+        if (!port) return false;
+
+        lv2_atom_forge_set_buffer(&forge, (uint8_t*)port, port->atom.size);
+        LV2_Atom_Forge_Frame seq_frame;
+        lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+
+        // Lanes are compared word by word; the common case is no change
+        uint32_t changed_lanes = 0;
+        for (int i = 0; i < n_lanes; i++) {
+            if (s.lanes[i] != published.lanes[i] || !has_published) changed_lanes |= 1u << i;
+        }
+        bool dirty = changed_lanes || s.step != published.step || s.chaos != published.chaos ||
+                     (has_chord && (s.chord != published.chord || s.root != published.root));
+
+        // A delta that does not fit stays pending for a later block
+        bool fits = forge.size - forge.offset >= MAX_OBJECT_BYTES;
+
+        uint64_t time = now + frames;
+        bool publish = dirty && fits && (!has_published || time - last_publish >= min_interval);
+        if (publish) {
+            uint32_t values[StateSnapshot::MAX_LANES];
+            uint32_t n_values = 0;
+            for (int i = 0; i < n_lanes; i++) {
+                if (changed_lanes & (1u << i)) values[n_values++] = s.lanes[i];
+            }
+
+            LV2_Atom_Forge_Frame obj_frame;
+            lv2_atom_forge_frame_time(&forge, frames);
+            lv2_atom_forge_object(&forge, &obj_frame, 0, State);
+            lv2_atom_forge_key(&forge, step);
+            lv2_atom_forge_int(&forge, (int32_t)s.step);
+            lv2_atom_forge_key(&forge, changed);
+            lv2_atom_forge_int(&forge, (int32_t)changed_lanes);
+            if (n_values) {
+                lv2_atom_forge_key(&forge, lanes);
+                lv2_atom_forge_vector(&forge, sizeof(int32_t), forge.Int, n_values, values);
+            }
+            if (has_chord) {
+                lv2_atom_forge_key(&forge, chord);
+                lv2_atom_forge_int(&forge, s.chord);
+                lv2_atom_forge_key(&forge, root);
+                lv2_atom_forge_int(&forge, s.root);
+            }
+            lv2_atom_forge_key(&forge, chaos);
+            lv2_atom_forge_float(&forge, s.chaos);
+            lv2_atom_forge_pop(&forge, &obj_frame);
+
+            published = s;
+            last_publish = time;
+            has_published = true;
+        }
+
+        lv2_atom_forge_pop(&forge, &seq_frame);
+        return publish;
+    }
+};
+
+#endif // CHAOS_STATE_NOTIFY_H
@@ -0,0 +1,176 @@
+#ifndef CHAOS_TEMPO_TRACKER_H
+#define CHAOS_TEMPO_TRACKER_H
+
+#include <cmath>
+#include <stdint.h>
+
+// Tempo and phase from trigger onsets. Inter-onset intervals go into a
+// decaying log-spaced histogram, together with the mean of each pair of
+// neighbouring intervals so that swung long/short steps count at the even
+// step they average to. Once the histogram holds SEED_INTERVALS intervals
+// its peak seeds the step period; after that a phase-locked update follows
+// tempo drift, treating intervals that span several steps as multiples of
+// the period, and the period is re-seeded whenever the histogram peak moves
+// away from it. A step grid is carried alongside: the expected time of the
+// next step moves on by whole periods and is only nudged toward the onsets,
+// so hits measured against it are offsets from the grid rather than from
+// the previous hit. State is fixed-size and each onset costs O(1).
+struct TempoTracker {
+    static const int BINS = 64;
+    static const int SEED_INTERVALS = 4;
+    static constexpr double MIN_PERIOD_SEC = 0.04;  // 16ths at ~375 BPM
+    static constexpr double MAX_PERIOD_SEC = 2.0;   // Quarters at 30 BPM
+    static constexpr double GRID_GAIN = 0.1;        // Share of an onset's grid error corrected
+    static constexpr double RESEED_RATIO = 1.15;    // Peak this far from the period re-seeds it
+
+    // Scalars read every block come first; the histogram is only touched
+    // two bins per onset
+    double period;          // Samples per step, 0 until locked
+    double next_step;       // Absolute sample time the grid expects the next step
+    uint64_t last_onset;    // Absolute sample time of the last onset
+    uint64_t step_count;    // Steps since lock, for beat phase
+    double rate;
+    double steps_per_beat;  // Triggers per quarter note for this plugin
+    double min_period;
+    double log_range;
+    double prev_ioi;        // Interval before the last one, 0 if none
+    int intervals;          // Intervals seen, counted up to SEED_INTERVALS
+    bool have_onset;
+
+    // Histogram with lazy decay: new entries get a growing weight instead of
+    // every bin being scaled down on each onset
+    int peak_bin;
+    float hist_weight;
+    float hist[BINS];
+
+    void init(double sample_rate, double triggers_per_beat) {
+        rate = sample_rate;
+        steps_per_beat = triggers_per_beat;
+        min_period = MIN_PERIOD_SEC * rate;
+        log_range = log(MAX_PERIOD_SEC / MIN_PERIOD_SEC);
+        for (int i = 0; i < BINS; i++) hist[i] = 0.0f;
+        hist_weight = 1.0f;
+        peak_bin = -1;
+        last_onset = 0;
+        have_onset = false;
+        period = 0.0;
+        next_step = 0.0;
+        step_count = 0;
+        prev_ioi = 0.0;
+        intervals = 0;
+    }
+
+    double binCenter(int bin) const {
+        return min_period * exp(log_range * (bin + 0.5) / BINS);
+    }
+
+    void addInterval(double ioi) {
+        int bin = (int)(BINS * log(ioi / min_period) / log_range);
+        if (bin < 0 || bin >= BINS) return;
+
+        hist[bin] += hist_weight;
+        hist_weight *= 1.1f;  // Older entries fade by 10% per entry
+        if (peak_bin < 0 || hist[bin] > hist[peak_bin]) peak_bin = bin;
+
+        // Rare renormalisation keeps the weights in float range
+        if (hist_weight > 1e6f) {
+            for (int i = 0; i < BINS; i++) hist[i] /= hist_weight;
+            hist_weight = 1.0f;
+        }
+    }
+
+    // Period from the histogram peak, with the grid restarted at `time`
+    void seed(uint64_t time) {
+        period = binCenter(peak_bin);
+        next_step = (double)time + period;
+        step_count = 0;
+    }
+
+    void onset(uint64_t time) {
+        if (!have_onset || time <= last_onset) {
+            have_onset = true;
+            last_onset = time;
+            return;
+        }
+
+        double ioi = (double)(time - last_onset);
+        last_onset = time;
+
+        // Flams and double hits are shorter than half a step: ignore them
+        if (locked() && ioi < 0.5 * period) return;
+
+        const double pair = prev_ioi;
+        prev_ioi = ioi;
+        addInterval(ioi);
+        if (pair > 0.0) addInterval(0.5 * (pair + ioi));
+        if (intervals < SEED_INTERVALS) intervals++;
+
+        if (!locked()) {
+            if (intervals >= SEED_INTERVALS && peak_bin >= 0) seed(time);
+            return;
+        }
+
+        // The histogram has settled on another tempo
+        const double peak = binCenter(peak_bin);
+        if (peak > period * RESEED_RATIO || period > peak * RESEED_RATIO) {
+            seed(time);
+            return;
+        }
+
+        // A long and a short single step are measured as their mean, so
+        // swing does not pull the period back and forth
+        double steps = floor(ioi / period + 0.5);
+        if (steps < 1.0) steps = 1.0;
+        double measured = ioi / steps;
+        if (steps == 1.0 && pair > 0.0 && floor(pair / period + 0.5) == 1.0) measured = 0.5 * (pair + ioi);
+
+        double error = (steps <= 4.0) ? measured - period : period;
+        if (fabs(error) < 0.25 * period) {
+            period += 0.2 * error;
+            step_count += (uint64_t)steps;
+            advanceGrid((double)time);
+        }
+    }
+
+    // The grid step nearest a locked onset becomes the current one; the
+    // next is a period on, pulled a little toward where the onset fell
+    void advanceGrid(double time) {
+        double steps = floor((time - next_step) / period + 0.5);
+        if (steps < 0.0) steps = 0.0;
+        double current = next_step + steps * period;
+        next_step = current + period + GRID_GAIN * (time - current);
+    }
+
+    bool locked() const { return period > 0.0; }
+
+    float bpm() const {
+        return locked() ? (float)(60.0 * rate / (period * steps_per_beat)) : 0.0f;
+    }
+
+    // Position within the beat (0-1) at absolute sample time `now`
+    float phase(uint64_t now) const {
+        if (!locked() || now < last_onset) return 0.0f;
+        double steps = step_count + (double)(now - last_onset) / period;
+        return (float)fmod(steps / steps_per_beat, 1.0);
+    }
+
+    // Expected absolute sample time of the next grid step, 0 when not locked
+    uint64_t predictNext() const {
+        return locked() ? (uint64_t)(next_step + 0.5) : 0;
+    }
+
+    // Absolute sample time of the grid step the last locked onset fell on
+    uint64_t lastStep() const {
+        return locked() ? (uint64_t)(next_step - period + 0.5) : 0;
+    }
+
+    // Samples from the nearest grid step to absolute time `time`, negative
+    // when early; 0 when not locked
+    double gridOffset(uint64_t time) const {
+        if (!locked()) return 0.0;
+        double from_next = (double)time - next_step;
+        return from_next - floor(from_next / period + 0.5) * period;
+    }
+};
+
+#endif // CHAOS_TEMPO_TRACKER_H
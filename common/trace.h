@@ -0,0 +1,160 @@
+#ifndef CHAOS_TRACE_H
+#define CHAOS_TRACE_H
+
+// Span recorder for looking inside run(). Build with -DCHAOS_TRACE (`make
+// trace`) and each instance keeps its last TraceRing::CAPACITY spans; on
+// cleanup they are written as Chrome trace JSON (chrome://tracing, Perfetto)
+// to $CHAOS_TRACE_DIR/<plugin>-<instance>.json, default the current
+// directory. Without CHAOS_TRACE the macros compile to nothing and their
+// arguments are not evaluated.
+//
+//   TRACE_SPAN(span, trace, TRACE_RUN);
+//   ...
+//   TRACE_ARGS(span, events_in, events_out);
+//   TRACE_ARG3(span, kits);  // Spans with a third argument name
+
+#ifdef CHAOS_TRACE
+
+#include <lv2/atom/atom.h>
+#include <lv2/atom/util.h>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum TraceName {
+    TRACE_RUN,
+    TRACE_ONSETS,
+    TRACE_TRIGGER,
+    TRACE_REGENERATE,
+    TRACE_DETECT_CHORD,
+    TRACE_VOICE_LEADING,
+    TRACE_PHRASE,
+    TRACE_NOTIFY,
+    TRACE_NUM_NAMES
+};
+
+static const char* const trace_names[TRACE_NUM_NAMES] = {
+    "run", "onsets", "trigger", "regenerate", "detect_chord", "voice_leading", "phrase", "notify"
+};
+
+// Names of the span arguments, per span name. Unnamed arguments, and a
+// third one the span did not set, are not written.
+static const char* const trace_arg_names[TRACE_NUM_NAMES][3] = {
+    {"events_in", "events_out", ""},
+    {"samples", "onsets", ""},
+    {"position", "notes", "kits"},  // Step or beat, notes emitted or sounding, drum kits stepped
+    {"euclidean", "learned", ""},
+    {"notes", "chord", ""},
+    {"voices", "distance", ""},
+    {"steps", "", ""},
+    {"published", "", ""}
+};
+
+static inline uint64_t traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Events in an atom sequence, for span arguments
+static inline int32_t traceCountEvents(const LV2_Atom_Sequence* seq) {
+    int32_t count = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(seq, ev) count++;
+    return count;
+}
+
+struct TraceEvent {
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint16_t name;
+    uint16_t n_args;
+    int32_t args[3];
+};
+
+// Single-producer ring: run() writes, the dumper reads. The producer never
+// waits; when the ring is full the oldest spans are overwritten.
+struct TraceRing {
+    static const uint32_t CAPACITY = 4096;  // Power of two
+
+    TraceEvent events[CAPACITY];
+    std::atomic<uint32_t> head;  // Spans ever written
+    uint32_t instance_id;
+
+    void init() {
+        static std::atomic<uint32_t> next_id(0);
+        head.store(0, std::memory_order_relaxed);
+        instance_id = next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record(uint16_t name, uint64_t start_ns, uint64_t end_ns, const int32_t* args, uint16_t n_args) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        TraceEvent& ev = events[h & (CAPACITY - 1)];
+        ev.start_ns = start_ns;
+        ev.duration_ns = (uint32_t)(end_ns - start_ns);
+        ev.name = name;
+        ev.n_args = n_args;
+        ev.args[0] = args[0];
+        ev.args[1] = args[1];
+        ev.args[2] = args[2];
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Not realtime safe. Spans recorded while this runs may be skipped.
+    bool dump(const char* plugin) const {
+        const char* dir = getenv("CHAOS_TRACE_DIR");
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s-%u.json", dir ? dir : ".", plugin, instance_id);
+        FILE* f = fopen(path, "w");
+        if (!f) return false;
+
+        uint32_t end = head.load(std::memory_order_acquire);
+        uint32_t begin = (end > CAPACITY) ? end - CAPACITY : 0;
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (uint32_t i = begin; i < end; i++) {
+            const TraceEvent& ev = events[i & (CAPACITY - 1)];
+            if (ev.name >= TRACE_NUM_NAMES) continue;
+            const char* const* args = trace_arg_names[ev.name];
+            fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":1,\"tid\":%u,\"args\":{\"%s\":%d",
+                    (i == begin) ? "" : ",", trace_names[ev.name], plugin, ev.start_ns / 1000.0,
+                    ev.duration_ns / 1000.0, instance_id, args[0], ev.args[0]);
+            for (int a = 1; a < ev.n_args; a++) {
+                if (args[a][0]) fprintf(f, ",\"%s\":%d", args[a], ev.args[a]);
+            }
+            fprintf(f, "}}\n");
+        }
+        fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+        fclose(f);
+        return true;
+    }
+};
+
+// Records one span from construction to the end of the scope
+struct TraceSpan {
+    TraceRing& ring;
+    uint64_t start_ns;
+    uint16_t name;
+    uint16_t n_args;
+    int32_t args[3];
+
+    TraceSpan(TraceRing& r, uint16_t n) : ring(r), start_ns(traceNow()), name(n), n_args(2) {
+        args[0] = args[1] = args[2] = 0;
+    }
+    ~TraceSpan() { ring.record(name, start_ns, traceNow(), args, n_args); }
+};
+
+#define TRACE_SPAN(var, ring, name) TraceSpan var((ring), (name))
+#define TRACE_ARGS(var, a, b) do { (var).args[0] = (int32_t)(a); (var).args[1] = (int32_t)(b); } while (0)
+#define TRACE_ARG3(var, c) do { (var).args[2] = (int32_t)(c); (var).n_args = 3; } while (0)
+
+#else
+
+#define TRACE_SPAN(var, ring, name) do {} while (0)
+#define TRACE_ARGS(var, a, b) do {} while (0)
+#define TRACE_ARG3(var, c) do {} while (0)
+
+#endif // CHAOS_TRACE
+
+#endif // CHAOS_TRACE_H
@@ -4,10 +4,30 @@
 #include <lv2/atom/util.h>
 #include <lv2/atom/forge.h>
 #include <lv2/midi/midi.h>
+#include <lv2/state/state.h>
+#include <lv2/worker/worker.h>
 #include <cmath>
 #include <cstring>
+#include <new>
 #include <stdlib.h>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "cc_map.h"
+#include "chaos_table.h"
+#include "drum_kit.h"
+#include "note_queue.h"
+#include "output_budget.h"
+#include "state_notify.h"
+#include "tempo_tracker.h"
+#include "trace.h"
+
+#ifdef CHAOS_FOOTPRINT
+#include "footprint.h"
+#endif
+
 #define MIDI_CHAOS_AMEN_URI "http://github.com/danja/midi-chaos-amen"
 
 enum PortIndex {
@@ -23,9 +43,36 @@ enum PortIndex {
     TOM_LOW_VELOCITY  = 9,
     TOM_MID_VELOCITY  = 10,
     TOM_HIGH_VELOCITY = 11,
-    SPARSITY          = 12
+    SPARSITY          = 12,
+    CC_LEARN          = 13,
+    AUDIO_IN          = 14,
+    ONSET_THRESHOLD   = 15,
+    TEMPO_BPM         = 16,
+    TEMPO_PHASE       = 17,
+    RHYTHM_MODE       = 18,
+    NOTIFY            = 19,
+    CHAOS_AMOUNT      = 20,
+    KICK_LENGTH       = 21,
+    SNARE_LENGTH      = 22,
+    HIHAT_LENGTH      = 23,
+    COWBELL_LENGTH    = 24,
+    TOM_LOW_LENGTH    = 25,
+    TOM_MID_LENGTH    = 26,
+    TOM_HIGH_LENGTH   = 27,
+    KIT_LEARN         = 28,
+    KITS              = 29,
+    ORNAMENTS         = 30
 };
 
+// Kit Learn values: 1-7 learn a lane's input note, 8-14 its output
+static const int KIT_LEARN_OUTPUT = 1 + DrumKit::LANES;
+
+// Kits one instance can run, each driven by its own input channel
+static const int MAX_KITS = 16;
+
+// Default kit: GM drum notes on channel 10
+static const uint8_t GM_DRUM_CHANNEL = 9;
+
 // MIDI drum notes (GM standard, channel 10)
 enum DrumNotes {
     KICK_NOTE     = 36,  // C2
@@ -37,157 +84,802 @@ enum DrumNotes {
     TOM_HIGH_NOTE = 45   // A2
 };
 
+// Order in which lanes keep their hits when the output budget runs short:
+// backbeat first, ghost hats last
+static const int drum_priority[7] = {0, 1, 4, 5, 6, 3, 2};
+
+// Tables shared by every instance. Patterns hold one bit per step (bit i is
+// step i), so a lane is a 16-bit word instead of 16 bools.
+static const uint16_t amen_pattern[7] = {
+    0x0241, // kick      x.....x..x......
+    0x5010, // snare     ....x.......x.x.
+    0xFFFF, // hihat     xxxxxxxxxxxxxxxx
+    0x0484, // cowbell   ..x....x..x.....
+    0x0100, // tom low   ........x.......
+    0x0800, // tom mid   ...........x....
+    0x2008  // tom high  ...x.........x..
+};
+
+static const uint8_t drum_notes[7] = {
+    KICK_NOTE, SNARE_NOTE, HIHAT_NOTE, COWBELL_NOTE,
+    TOM_LOW_NOTE, TOM_MID_NOTE, TOM_HIGH_NOTE
+};
+
+// Lanes run at their own lengths (polymeter), up to four bars of 16ths.
+// Patterns are one uint64_t per lane, bit i = lane step i.
+static const int MAX_LANE_STEPS = 64;
+
+static inline uint64_t laneMask(int length) {
+    return (length >= 64) ? ~0ULL : ((1ULL << length) - 1);
+}
+
+// A one-bar pattern repeated (or cut) to fill a lane of `length` steps
+static inline uint64_t tileBar(uint16_t bar, int length) {
+    uint64_t bits = 0;
+    for (int i = 0; i < length; i += 16) bits |= (uint64_t)bar << i;
+    return bits & laneMask(length);
+}
+
+// Learned feel of one hit: where it fell against the tempo grid and how
+// hard. Offsets are in 1/GROOVE_UNITS of a step, up to half a step either
+// way; velocity 0 means nothing was learned there.
+struct GrooveHit {
+    int8_t offset;
+    uint8_t velocity;
+};
+
+static const int GROOVE_UNITS = 128;
+static const double GROOVE_JITTER = 32.0;    // Offset units of chaos at full intensity
+static const double VELOCITY_JITTER = 32.0;
+
+// Sub-step ornaments: ratchets (2-8 strokes in a step, fading), snare
+// rolls (6-8 strokes, rising) and flams (soft grace stroke, main stroke
+// FLAM_SECONDS later). Chance per hit at full Ornaments, per lane: hats
+// ratchet, the snare rolls and flams, the kick is left mostly alone.
+static const float ornament_weight[7] = {0.1f, 0.6f, 0.5f, 0.3f, 0.3f, 0.3f, 0.3f};
+static const double FLAM_SECONDS = 0.02;
+static const int SNARE_LANE = 1;
+
+enum OrnamentKind {
+    ORNAMENT_NONE,
+    ORNAMENT_FLAM,
+    ORNAMENT_RATCHET,
+    ORNAMENT_ROLL
+};
+
+// The ornament picked for one hit; strokes counts the hit itself
+struct Ornament {
+    uint8_t kind;
+    uint8_t strokes;
+};
+
+// Tag of a kit's early hit on one lane in the note queue
+static inline uint8_t earlyTag(int kit, int drum) {
+    return (uint8_t)(0x80 | kit << 3 | drum);
+}
+
+static inline uint8_t scaleVelocity(uint8_t velocity, double scale) {
+    return (uint8_t)fmax(1, fmin(127, velocity * scale + 0.5));
+}
+
+// Used while a port is unconnected
+static const uint8_t default_velocity[7] = {100, 90, 70, 80, 85, 85, 85};
+static const float default_chaos_k = 3.8f;
+static const float default_chaos_intensity = 0.3f;
+
+// Euclidean rhythms E(k, n) for bars of up to 64 steps, built at compile
+// time. Bit i of rhythm[n][k] is set when step i carries one of k onsets
+// spread as evenly as possible over n steps (Bresenham form of Bjorklund).
+static const int EUCLID_MAX_STEPS = 64;
+
+struct EuclidTable {
+    uint64_t rhythm[EUCLID_MAX_STEPS + 1][EUCLID_MAX_STEPS + 1];
+    
+    constexpr EuclidTable() : rhythm() {
+        for (int n = 1; n <= EUCLID_MAX_STEPS; n++) {
+            for (int k = 0; k <= n; k++) {
+                uint64_t bits = 0;
+                for (int i = 0; i < n; i++) {
+                    if ((i * k) % n < k) bits |= 1ULL << i;
+                }
+                rhythm[n][k] = bits;
+            }
+        }
+    }
+};
+
+static constexpr EuclidTable euclid_table;
+
+// E(k, n) rotated left by `rotation` steps: a lookup and a bit rotate
+static inline uint64_t euclidRhythm(int k, int n, int rotation) {
+    if (n < 1) n = 1;
+    if (n > EUCLID_MAX_STEPS) n = EUCLID_MAX_STEPS;
+    if (k < 0) k = 0;
+    if (k > n) k = n;
+    uint64_t bits = euclid_table.rhythm[n][k];
+    int r = rotation % n;
+    if (r <= 0) return bits;
+    uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1);
+    return ((bits >> r) | (bits << (n - r))) & mask;
+}
+
+// Onset count range per lane in Euclidean mode (per 16 steps)
+static const uint8_t euclid_hits[7][2] = {
+    {2, 5},  // kick
+    {2, 4},  // snare
+    {6, 16}, // hihat
+    {2, 5},  // cowbell
+    {0, 2},  // tom low
+    {0, 2},  // tom mid
+    {0, 3}   // tom high
+};
+
+// Peak absolute value of a block of samples, four at a time where SSE is available
+static inline float blockPeak(const float* x, uint32_t n) {
+    uint32_t i = 0;
+    float peak = 0.0f;
+#if defined(__SSE__)
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 vpeak = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        vpeak = _mm_max_ps(vpeak, _mm_andnot_ps(sign_mask, _mm_loadu_ps(x + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vpeak);
+    peak = fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3]));
+#endif
+    for (; i < n; i++) {
+        float a = fabsf(x[i]);
+        if (a > peak) peak = a;
+    }
+    return peak;
+}
+
+// Onset detector for the audio trigger input. Works on 16-sample chunks:
+// the vectorised peak of each chunk feeds a slow background envelope, and
+// only a chunk that jumps above both the threshold and the background is
+// scanned sample by sample for the exact onset frame.
+struct OnsetDetector {
+    static const uint32_t CHUNK = 16;
+    static const uint32_t MAX_ONSETS = 32;
+    
+    float background;     // Slow envelope of recent chunk peaks
+    float background_coef;
+    uint32_t hold;        // Samples left before another onset may fire
+    uint32_t hold_samples;
+    
+    void init(double rate) {
+        background = 0.0f;
+        background_coef = 1.0f - (float)exp(-(double)CHUNK / (0.1 * rate)); // ~100ms
+        hold = 0;
+        hold_samples = (uint32_t)(0.05 * rate); // Max 20 onsets per second
+    }
+    
+    // Writes onset frames in ascending order, returns how many were found
+    uint32_t process(const float* in, uint32_t n_samples, float threshold, uint32_t* onsets) {
+        uint32_t count = 0;
+        for (uint32_t start = 0; start < n_samples; start += CHUNK) {
+            uint32_t len = (n_samples - start < CHUNK) ? n_samples - start : CHUNK;
+            float peak = blockPeak(in + start, len);
+            float level = fmaxf(threshold, 2.0f * background);
+            
+            if (hold == 0 && peak > level && count < MAX_ONSETS) {
+                uint32_t i = 0;
+                while (i < len - 1 && fabsf(in[start + i]) <= level) i++;
+                onsets[count++] = start + i;
+                hold = hold_samples;
+            }
+            
+            hold = (hold > len) ? hold - len : 0;
+            background += background_coef * (peak - background);
+        }
+        return count;
+    }
+};
+
 typedef struct {
     LV2_URID atom_Blank;
     LV2_URID atom_Sequence;
     LV2_URID midi_MidiEvent;
+    LV2_URID atom_Chunk;
+    LV2_URID state_ccMap;
+    LV2_URID state_kitMap;
 } URIDs;
 
-// Main plugin class
-class MidiChaosAmen {
-private:
-    URIDs urids;
-    LV2_URID_Map* map;
-    
-    uint32_t clock_count;
-    uint32_t current_step;
-    uint32_t learn_step;
-    bool learning_active;
+// State of N kits, laid out as structure-of-arrays, [lane][kit] or [kit],
+// so stepping and regeneration are plain loops across the running kits
+// that the compiler can vectorise; kits not being stepped keep their state
+// through a select rather than a branch. Rows of several kits are padded
+// to a multiple of 8 so those loops keep whole vectors. The hot arrays come
+// first, the learned pattern and groove last.
+template <int N>
+struct KitBank {
+    static const int SIZE = N;
+    static const int STRIDE = (N == 1) ? 1 : (N + 7) & ~7;
     
-    // Chaos variables
-    double chaos_x;
+    // Every trigger
+    double chaos_x[STRIDE];
+    uint64_t current_pattern[7][STRIDE];  // Current chaotic pattern
+    uint32_t current_step[STRIDE];        // Position in the 16-step bar, for regeneration
+    uint32_t step_count[STRIDE];          // Steps since instantiation
+    uint8_t lane_cursor[7][STRIDE];       // Each lane's position in its own length
+    uint8_t step_hits[STRIDE];            // Lanes hitting on the cursors, prepared before the trigger arrives
+    uint8_t early_hits[STRIDE];           // Lanes of the prepared step already queued ahead of the trigger
+    uint8_t first_kit;                    // Kit number of entry 0
+    TempoTracker tempo[N];                // Step period and grid from each kit's own triggers
     
-    // Base Amen pattern - now 7 instruments
-    bool base_pattern[7][16] = {
-        {1,0,0,0,0,0,1,0,0,1,0,0,0,0,0,0}, // kick
-        {0,0,0,0,1,0,0,0,0,0,0,0,1,0,1,0}, // snare
-        {1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1}, // hihat
-        {0,0,1,0,0,0,0,1,0,0,1,0,0,0,0,0}, // cowbell
-        {0,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0}, // tom low
-        {0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,0}, // tom mid
-        {0,0,0,1,0,0,0,0,0,0,0,0,0,1,0,0}  // tom high
-    };
+    // Learn mode only
+    uint64_t learned_pattern[7][STRIDE];
+    GrooveHit groove[N][7][MAX_LANE_STEPS];  // Per kit, lane and lane step
     
-    // Learned pattern buffer
-    bool learned_pattern[7][16];
-    
-    // Current chaotic pattern
-    bool current_pattern[7][16];
-    
-    // Ports with null pointer safety
+    void init(int kit, double rate) {
+        memset(this, 0, sizeof(*this));
+        first_kit = (uint8_t)kit;
+        for (int i = 0; i < N; i++) {
+            // Kits start from different points on the map so they do not
+            // play in unison
+            chaos_x[i] = 0.5 - 0.0123 * (kit + i);
+            tempo[i].init(rate, 4); // Triggers are 16th-note steps
+        }
+    }
+};
+
+// Kit 0 lives in the instance. The others share one bank, allocated by the
+// host's worker the first time Kits goes above 1 (at instantiate on hosts
+// without a worker), which kit 0's triggers never touch.
+typedef KitBank<1> FirstKit;
+typedef KitBank<MAX_KITS - 1> OtherKits;
+
+// Main plugin class. Members are ordered by how often run() touches them:
+// the per-block state first, per-trigger state next, then what is only used
+// on parameter changes or in learn mode. Instances are cache-line aligned.
+//
+// One instance runs up to MAX_KITS independent kits, picked by the input
+// channel. Each kit function is written once over a KitBank and called on
+// kit 0's bank and, with more kits running, on the other kits' bank.
+class alignas(64) MidiChaosAmen {
+private:
+    // Every block
     const LV2_Atom_Sequence* midi_in;
     LV2_Atom_Sequence* midi_out;
-    const float* learn_mode;
+    LV2_Atom_Forge forge;  // Initialised once, only the buffer changes per block
+    URIDs urids;
+    uint64_t clock_count;  // Samples processed since instantiation
+    uint32_t last_frame;   // Frame of the last note written this block
+    CCModulation cc;       // MIDI CC control of chaos parameters
     const float* chaos_k;
     const float* chaos_intensity;
-    const float* kick_velocity;
-    const float* snare_velocity;
-    const float* hihat_velocity;
-    const float* cowbell_velocity;
-    const float* tom_low_velocity;
-    const float* tom_mid_velocity;
-    const float* tom_high_velocity;
     const float* sparsity;
+    const float* cc_learn;
+    const float* kit_learn;
+    const float* kit_count;
+    const float* learn_mode;
+    const float* audio_in;
+    const float* onset_threshold;
+    float* tempo_bpm;
+    float* tempo_phase;
+    uint8_t n_kits;
+    uint8_t active_drums[MAX_KITS];  // Sparsity tracking - drum types triggered on input this block
     
-    // Sparsity tracking - which drum types were triggered on input
-    bool active_drums[7];
-    
-    // Default values for safety
-    float default_chaos_k;
-    float default_chaos_intensity;
-    float default_kick_velocity;
-    float default_snare_velocity;
-    float default_hihat_velocity;
-    float default_cowbell_velocity;
-    float default_tom_low_velocity;
-    float default_tom_mid_velocity;
-    float default_tom_high_velocity;
-    
-    // Drum note mapping
-    uint8_t drum_notes[7] = {
-        KICK_NOTE, SNARE_NOTE, HIHAT_NOTE, COWBELL_NOTE,
-        TOM_LOW_NOTE, TOM_MID_NOTE, TOM_HIGH_NOTE
-    };
-    
-    void initializePatterns() {
+    // Every trigger
+    uint16_t euclid_kits;         // Kits whose pattern was generated in Euclidean mode
+    uint8_t lane_length[7];
+    DrumKit kit_map;              // Note dispatch and output notes
+    bool learning_active;
+    const float* rhythm_mode;
+    const float* chaos_amount;
+    const float* ornaments;
+    const ChaosTable* chaos_table;  // Shared, built at the first instantiate
+    const float* velocity_ports[7];
+    const float* length_ports[7];
+    OtherKits* others;            // Kits 1 and up, null until more than one kit is asked for
+    
+    // Audio trigger input
+    OnsetDetector onset_detector;
+    
+    // Pattern and step changes for UIs
+    LV2_Atom_Sequence* notify;
+    StateNotifier notifier;
+    
+    // Kit 0: hot arrays here, its learned groove in the cold part below
+    FirstKit first;
+    
+    // Setup only
+    LV2_URID_Map* map;
+    LV2_Worker_Schedule* schedule;  // Null if the host has no worker
+    bool kits_requested;            // The other kits' bank has been asked of the worker
+    double sample_rate;
+    
+    // Only touched while grooved notes are waiting for their frame
+    NoteQueue pending;
+
+#ifdef CHAOS_TRACE
+    TraceRing trace;
+#endif
+
+    template <typename Bank>
+    void initializePatterns(Bank& b) {
         // Copy base to learned and current
-        memcpy(learned_pattern, base_pattern, sizeof(base_pattern));
-        memcpy(current_pattern, base_pattern, sizeof(base_pattern));
+        for (int drum = 0; drum < 7; drum++) {
+            uint64_t bits = tileBar(amen_pattern[drum], lane_length[drum]);
+            for (int i = 0; i < Bank::SIZE; i++) {
+                b.learned_pattern[drum][i] = bits;
+                b.current_pattern[drum][i] = bits;
+            }
+        }
+    }
+    
+    template <typename Bank>
+    void clearLearnedPattern(Bank& b, int i) {
+        for (int drum = 0; drum < 7; drum++) b.learned_pattern[drum][i] = 0;
+        memset(b.groove[i], 0, sizeof(b.groove[i]));
     }
     
+    // Kits that are not running are left alone; they are cleared when they
+    // start if learning is still on
     void clearLearnedPattern() {
-        // Clear learned pattern
-        memset(learned_pattern, 0, sizeof(learned_pattern));
+        clearLearnedPattern(first, 0);
+        for (int i = 0; i < n_kits - 1; i++) clearLearnedPattern(*others, i);
     }
     
-    int getDrumIndex(uint8_t note) {
-        for (int i = 0; i < 7; i++) {
-            if (drum_notes[i] == note) return i;
-        }
-        return -1; // Not found
+    int getDrumIndex(uint8_t note) { return kit_map.lane(note); }
+    
+    // With one kit every channel drives it; with more, channel n drives kit n
+    int getKitForChannel(uint8_t channel) {
+        if (n_kits == 1) return 0;
+        return (channel < n_kits) ? channel : -1;
     }
     
-    void learnFromMidi(uint8_t note, uint32_t step) {
-        if (!learning_active || step >= 16) return;
+    uint8_t getOutChannel(int kit, int drum) {
+        return (n_kits == 1) ? kit_map.out_channel[drum] : (uint8_t)kit;
+    }
+    
+    // Record a hit at the lane's current step, with its offset from the
+    // tempo tracker's step grid and its velocity
+    template <typename Bank>
+    void learnFromMidi(Bank& b, int i, int drum, uint64_t time, uint8_t velocity) {
+        if (!learning_active || drum < 0) return;
         
-        int drum_idx = getDrumIndex(note);
-        if (drum_idx >= 0) {
-            learned_pattern[drum_idx][step] = true;
-        }
+        uint8_t step = b.lane_cursor[drum][i];
+        b.learned_pattern[drum][i] |= 1ULL << step;
+        
+        const TempoTracker& tempo = b.tempo[i];
+        double offset = 0.0;
+        if (tempo.locked()) offset = tempo.gridOffset(time) / tempo.period * GROOVE_UNITS;
+        GrooveHit& hit = b.groove[i][drum][step];
+        hit.offset = (int8_t)fmax(-GROOVE_UNITS / 2, fmin(GROOVE_UNITS / 2 - 1, floor(offset + 0.5)));
+        hit.velocity = velocity;
+    }
+    
+    void learnFromMidi(int kit, int drum, uint64_t time, uint8_t velocity) {
+        if (kit == 0) learnFromMidi(first, 0, drum, time, velocity);
+        else learnFromMidi(*others, kit - 1, drum, time, velocity);
+    }
+    
+    // A learned hit's offset in samples from its grid step and its velocity,
+    // both varied by chaos. Offsets need a tempo lock, else they are 0.
+    template <typename Bank>
+    int32_t grooveHit(Bank& b, int i, int drum, double k, double intensity, uint8_t* velocity) {
+        const GrooveHit& hit = b.groove[i][drum][b.lane_cursor[drum][i]];
+        double offset = hit.offset + (nextChaos(b, i, k) - 0.5) * intensity * GROOVE_JITTER;
+        double v = hit.velocity + (nextChaos(b, i, k) - 0.5) * intensity * VELOCITY_JITTER;
+        *velocity = (uint8_t)fmax(1, fmin(127, v));
+        offset = fmax(-GROOVE_UNITS / 2, fmin(GROOVE_UNITS / 2, offset));
+        return b.tempo[i].locked() ? (int32_t)(offset * b.tempo[i].period / GROOVE_UNITS) : 0;
     }
     
-    void generateChaoticPattern() {
-        if (!chaos_k || !chaos_intensity) return;
+    // Hits of the prepared step that are learned early go out ahead of its
+    // trigger, placed against the grid step the tempo tracker expects next.
+    // Lanes already in early_hits are left alone, and a hit whose time is
+    // not after `now` is left to sound at the trigger.
+    template <typename Bank>
+    void queueEarlyHits(Bank& b, int i, uint64_t now) {
+        if (!learning_active || !b.tempo[i].locked()) return;
         
-        double k = *chaos_k;
-        double intensity = *chaos_intensity;
+        const int kit = b.first_kit + i;
+        const uint64_t expected = b.tempo[i].predictNext();
+        double k = getChaosK();
+        double intensity = getChaosIntensity();
+        for (int drum = 0; drum < 7; drum++) {
+            const GrooveHit& hit = b.groove[i][drum][b.lane_cursor[drum][i]];
+            if (!(b.step_hits[i] & ~b.early_hits[i] & (1 << drum)) || !hit.velocity || hit.offset >= 0) continue;
+            uint8_t velocity;
+            int32_t offset = grooveHit(b, i, drum, k, intensity, &velocity);
+            if (offset < 0 && (int64_t)(expected + offset - now) > 0 &&
+                pending.push(expected + offset, 0x90 | getOutChannel(kit, drum),
+                                           kit_map.out_note[drum], velocity, earlyTag(kit, drum))) {
+                b.early_hits[i] |= 1 << drum;
+            }
+        }
+    }
+    
+    // Take back a kit's early hits that have not sounded yet, before its
+    // prepared step is worked out again. Lanes that already sounded stay
+    // marked so the trigger does not play them twice.
+    template <typename Bank>
+    void dropEarlyHits(Bank& b, int i) {
+        for (int drum = 0; drum < 7; drum++) {
+            if ((b.early_hits[i] & (1 << drum)) && pending.removeTagged(earlyTag(b.first_kit + i, drum))) {
+                b.early_hits[i] &= ~(1 << drum);
+            }
+        }
+    }
+    
+    // Write queued notes due by `frames` in this block. Notes the output
+    // buffer cannot take wait for the next block; held-over notes go out at
+    // the last frame written, so frame times never go backwards.
+    void flushPending(LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames) {
+        const NoteQueue::Event* ev;
+        while ((ev = pending.due(clock_count + frames)) && budget->take()) {
+            int32_t at = (int32_t)(ev->time - (uint32_t)clock_count);  // Negative if held over
+            if (at < (int32_t)last_frame) at = last_frame;
+            writeMidiNote(forge, at, ev->msg[1], ev->msg[0] & 0x0F, ev->msg[2], true);
+            pending.pop();
+        }
+    }
+    
+    template <typename Bank>
+    double nextChaos(Bank& b, int i, double k) {
+        double x = k * b.chaos_x[i] * (1.0 - b.chaos_x[i]);
+        if (x < 0.0 || x > 1.0) x = 0.5;
+        b.chaos_x[i] = x;
+        return x;
+    }
+    
+    // Euclidean baseline: chaos picks each lane's onset count and rotation,
+    // the rhythm itself comes from the compile-time table. Onset counts are
+    // per 16 steps and scale with the lane length.
+    template <typename Bank>
+    void buildEuclidPattern(Bank& b, int i, uint64_t* lanes, double k) {
+        for (int drum = 0; drum < 7; drum++) {
+            int length = lane_length[drum];
+            int lo = (euclid_hits[drum][0] * length + 8) / 16;
+            int hi = (euclid_hits[drum][1] * length + 8) / 16;
+            int hits = lo + (int)(nextChaos(b, i, k) * (hi - lo + 0.999));
+            int rotation = (int)(nextChaos(b, i, k) * (length - 0.001));
+            lanes[drum] = euclidRhythm(hits, length, rotation);
+        }
+    }
+    
+    // Regenerate the kits of a bank in `kits`, bit i for entry i. The source
+    // patterns are set up per kit, the chaos pass then runs across the kits
+    // with the others left as they were, so kits reaching a bar line
+    // together share one pass.
+    template <typename Bank>
+    void generateChaoticPattern(Bank& b, uint32_t kits) {
+        TRACE_SPAN(span, trace, TRACE_REGENERATE);
+        TRACE_ARGS(span, getEuclidMode(), learning_active);
+        double k = getChaosK();
+        double intensity = getChaosIntensity();
         
         // Clamp values for safety
         k = fmax(1.0, fmin(4.0, k));
         intensity = fmax(0.0, fmin(1.0, intensity));
         
-        // Use learned pattern as base if learning was active
-        bool (*source_pattern)[16] = learning_active ? learned_pattern : base_pattern;
+        // Use learned pattern as base if learning was active, otherwise
+        // the Amen break or a Euclidean rhythm
+        uint64_t source_pattern[7][Bank::STRIDE];
+        memcpy(source_pattern, b.current_pattern, sizeof(source_pattern));
+        const bool euclid = getEuclidMode();
+        for (int i = 0; i < Bank::SIZE; i++) {
+            if (!(kits & (1u << i))) continue;
+            const uint16_t kit_bit = (uint16_t)(1 << (b.first_kit + i));
+            if (euclid) euclid_kits |= kit_bit;
+            else euclid_kits &= ~kit_bit;
+            if (euclid && !learning_active) {
+                uint64_t lanes[7];
+                buildEuclidPattern(b, i, lanes, k);
+                for (int drum = 0; drum < 7; drum++) source_pattern[drum][i] = lanes[drum];
+            } else {
+                for (int drum = 0; drum < 7; drum++) {
+                    source_pattern[drum][i] = learning_active ? b.learned_pattern[drum][i] & laneMask(lane_length[drum])
+                                                              : tileBar(amen_pattern[drum], lane_length[drum]);
+                }
+            }
+        }
+        int max_length = 0;
+        for (int drum = 0; drum < 7; drum++) {
+            if (lane_length[drum] > max_length) max_length = lane_length[drum];
+        }
         
         // Copy source pattern
-        memcpy(current_pattern, source_pattern, sizeof(current_pattern));
+        memcpy(b.current_pattern, source_pattern, sizeof(source_pattern));
         
-        for (int i = 0; i < 16; i++) {
-            // Generate chaos values with bounds checking
+        // Branch-free over kits up to the last one in `kits`: the others
+        // compute and discard
+        int end = 0;
+        while (end < Bank::SIZE && (kits >> end)) end++;
+        uint64_t active[Bank::STRIDE];
+        for (int i = 0; i < end; i++) active[i] = 0 - (uint64_t)((kits >> i) & 1);
+        
+        for (int s = 0; s < max_length; s++) {
+            const uint64_t bit = 1ULL << s;
             for (int drum = 0; drum < 7; drum++) {
-                chaos_x = k * chaos_x * (1.0 - chaos_x);
-                if (chaos_x < 0.0 || chaos_x > 1.0) chaos_x = 0.5;
+                if (s >= lane_length[drum]) continue;
                 
-                double chaos_val = chaos_x;
                 double threshold = 0.3 + (drum * 0.1); // Different sensitivity per drum
+                double add_below = intensity * threshold;
+                double drop_above = 1.0 - intensity * 0.15;
+                for (int i = 0; i < end; i++) {
+                    // Generate chaos values with bounds checking
+                    double x = k * b.chaos_x[i] * (1.0 - b.chaos_x[i]);
+                    x = ((x < 0.0) | (x > 1.0)) ? 0.5 : x;
+                    b.chaos_x[i] = active[i] ? x : b.chaos_x[i];
+                    
+                    // Apply chaos modifications
+                    uint64_t hit = source_pattern[drum][i] & bit;
+                    uint64_t add = ~hit & bit & (0 - (uint64_t)(x < add_below));
+                    uint64_t drop = hit & (0 - (uint64_t)(x > drop_above));
+                    b.current_pattern[drum][i] = (b.current_pattern[drum][i] | (add & active[i])) & ~(drop & active[i]);
+                }
+            }
+        }
+    }
+    
+    // Work out which lanes hit on the next step of the bank's first `n`
+    // kits ahead of their trigger, so the trigger itself only reads a bitmask
+    template <typename Bank>
+    void prepareStep(Bank& b, int n) {
+        uint8_t hits[Bank::STRIDE] = {};
+        for (int drum = 0; drum < 7; drum++) {
+            for (int i = 0; i < n; i++) {
+                hits[i] |= ((b.current_pattern[drum][i] >> b.lane_cursor[drum][i]) & 1) << drum;
+            }
+        }
+        memcpy(b.step_hits, hits, n);
+    }
+    
+    void prepareStep() {
+        prepareStep(first, 1);
+        if (n_kits > 1) prepareStep(*others, n_kits - 1);
+    }
+    
+    // Move every lane of the kits in `kits` on one step, wrapping each at
+    // its own length
+    template <typename Bank>
+    void advanceCursors(Bank& b, uint32_t kits, int n) {
+        for (int drum = 0; drum < 7; drum++) {
+            const uint8_t length = lane_length[drum];
+            for (int i = 0; i < n; i++) {
+                uint8_t next = b.lane_cursor[drum][i] + 1;
+                next = (next < length) ? next : 0;
+                b.lane_cursor[drum][i] = ((kits >> i) & 1) ? next : b.lane_cursor[drum][i];
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            uint32_t on = (kits >> i) & 1;
+            b.step_count[i] += on;
+            b.current_step[i] = (b.current_step[i] + on) % 16;
+        }
+    }
+    
+    // After a lane length change: the first `n` kits' lanes are re-aligned
+    // to their step count and regenerated so the new steps have content,
+    // and their next step is prepared again. Kits not running catch up
+    // when they start.
+    template <typename Bank>
+    void relength(Bank& b, const bool* changed, int n) {
+        for (int drum = 0; drum < 7; drum++) {
+            if (!changed[drum]) continue;
+            for (int i = 0; i < n; i++) b.lane_cursor[drum][i] = b.step_count[i] % lane_length[drum];
+        }
+        for (int i = 0; i < n; i++) dropEarlyHits(b, i);
+        generateChaoticPattern(b, (1u << n) - 1);
+        prepareStep(b, n);
+        for (int i = 0; i < n; i++) queueEarlyHits(b, i, clock_count);
+    }
+    
+    // Kits `from` up to `to` start running: their lanes are re-aligned to
+    // their step count, a learn session in progress starts empty for them,
+    // and they get a fresh pattern
+    void startKits(int from, int to) {
+        uint32_t started = 0;
+        for (int i = from - 1; i < to - 1; i++) {
+            for (int drum = 0; drum < 7; drum++) {
+                others->lane_cursor[drum][i] = others->step_count[i] % lane_length[drum];
+            }
+            if (learning_active) clearLearnedPattern(*others, i);
+            started |= 1u << i;
+        }
+        generateChaoticPattern(*others, started);
+    }
+    
+    // Lane lengths are read once per block
+    void syncLaneLengths() {
+        bool changed[7];
+        bool any = false;
+        for (int drum = 0; drum < 7; drum++) {
+            const float* port = length_ports[drum];
+            uint8_t length = port ? (uint8_t)fmax(1, fmin(MAX_LANE_STEPS, *port)) : 16;
+            changed[drum] = length != lane_length[drum];
+            lane_length[drum] = length;
+            any |= changed[drum];
+        }
+        if (any) {
+            relength(first, changed, 1);
+            if (n_kits > 1) relength(*others, changed, n_kits - 1);
+        }
+    }
+    
+    // Pick the ornament for one hit. Ratchets and rolls are spaced by the
+    // kit's tracked step period, so they need a tempo lock. Nothing is
+    // picked unless the note queue has room for a delayed hit and the
+    // stroke after it.
+    template <typename Bank>
+    Ornament pickOrnament(Bank& b, int i, int drum, float amount) {
+        Ornament ornament = {ORNAMENT_NONE, 1};
+        double k = getChaosK();
+        if (nextChaos(b, i, k) >= amount * ornament_weight[drum]) return ornament;
+        
+        const double kind = nextChaos(b, i, k);
+        if (kind < (drum == SNARE_LANE ? 0.4 : 0.3)) {
+            ornament.kind = ORNAMENT_FLAM;
+            ornament.strokes = 2;
+        } else if (b.tempo[i].locked()) {
+            const bool roll = drum == SNARE_LANE && kind < 0.7;
+            ornament.kind = roll ? ORNAMENT_ROLL : ORNAMENT_RATCHET;
+            ornament.strokes = roll ? 6 + (int)(nextChaos(b, i, k) * 2.999) : 2 + (int)(nextChaos(b, i, k) * 6.999);
+        }
+        if (pending.room() < 2) ornament.kind = ORNAMENT_NONE;
+        return ornament;
+    }
+    
+    // Velocity of the hit itself: a flam's grace stroke, or the first
+    // stroke of a ratchet or roll
+    static uint8_t leadVelocity(const Ornament& ornament, uint8_t velocity) {
+        switch (ornament.kind) {
+            case ORNAMENT_FLAM: return scaleVelocity(velocity, 0.5);
+            case ORNAMENT_RATCHET: return scaleVelocity(velocity, 1.0);
+            case ORNAMENT_ROLL: return scaleVelocity(velocity, 0.4);
+            default: return velocity;
+        }
+    }
+    
+    // Queue the strokes after a hit that went out at absolute time `time`
+    // with its velocity before the ornament; a full queue drops the last
+    // ones
+    template <typename Bank>
+    void queueOrnament(Bank& b, int i, int drum, const Ornament& ornament, uint64_t time,
+                       uint8_t velocity, uint8_t channel) {
+        const TempoTracker& tempo = b.tempo[i];
+        const uint8_t status = 0x90 | channel;
+        const uint8_t note = kit_map.out_note[drum];
+        if (ornament.kind == ORNAMENT_FLAM) {
+            pending.push(time + (uint64_t)(FLAM_SECONDS * tempo.rate), status, note, velocity);
+            return;
+        }
+        
+        const bool roll = ornament.kind == ORNAMENT_ROLL;
+        const int strokes = ornament.strokes;
+        const double from = roll ? 0.4 : 1.0;
+        const double to = roll ? 1.0 : 0.6;
+        for (int j = 1; j < strokes; j++) {
+            double ramp = from + (to - from) * j / (strokes - 1);
+            if (!pending.push(time + (uint64_t)(j * tempo.period / strokes), status, note,
+                              scaleVelocity(velocity, ramp))) break;
+        }
+    }
+    
+    // Play the current step of one kit, highest priority lanes first. Lanes
+    // with a learned groove play at their learned offset from the grid step
+    // and velocity; one whose time has already passed plays at the trigger.
+    template <typename Bank>
+    uint32_t playStep(Bank& b, int i, LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames, bool sparse_mode) {
+        const int kit = b.first_kit + i;
+        const uint32_t share = budget->share(0);
+        uint32_t allowance = share;
+        const uint8_t hits = b.step_hits[i] & ~b.early_hits[i];
+        const float ornament_amount = getOrnaments();
+        for (int p = 0; p < 7 && allowance > 0; p++) {
+            int drum = drum_priority[p];
+            if (hits & (1 << drum)) {
+                // Sparsity check: only output if this drum type was triggered on input
+                if (sparse_mode && !(active_drums[kit] & (1 << drum))) continue;
+                uint8_t velocity = getVelocityForDrum(drum);
+                uint8_t channel = getOutChannel(kit, drum);
+                int32_t delay = 0;
+                if (learning_active && b.groove[i][drum][b.lane_cursor[drum][i]].velocity) {
+                    int32_t offset = grooveHit(b, i, drum, getChaosK(), getChaosIntensity(), &velocity);
+                    if (b.tempo[i].locked()) {
+                        delay = (int32_t)((int64_t)b.tempo[i].lastStep() + offset - (int64_t)(clock_count + frames));
+                    }
+                }
+                Ornament ornament = {ORNAMENT_NONE, 1};
+                if (ornament_amount > 0.0f) ornament = pickOrnament(b, i, drum, ornament_amount);
+                const uint8_t lead = leadVelocity(ornament, velocity);
                 
-                // Apply chaos modifications
-                if (!source_pattern[drum][i] && chaos_val < intensity * threshold) {
-                    current_pattern[drum][i] = true;
-                } else if (source_pattern[drum][i] && chaos_val > (1.0 - intensity * 0.15)) {
-                    current_pattern[drum][i] = false;
+                // The ornament's other strokes only follow a hit that goes out
+                bool played = false;
+                if (delay > 0 && pending.push(clock_count + frames + delay, 0x90 | channel,
+                                              kit_map.out_note[drum], lead)) {
+                    played = true;
+                } else if (budget->take()) {
+                    writeMidiNote(forge, frames, kit_map.out_note[drum], channel, lead, true);
+                    played = true;
                 }
+                if (!played) continue;
+                allowance--;
+                if (ornament.kind != ORNAMENT_NONE) {
+                    queueOrnament(b, i, drum, ornament, clock_count + frames + (delay > 0 ? delay : 0),
+                                  velocity, channel);
+                }
+            }
+        }
+        return share - allowance;
+    }
+    
+    // Play and advance the kits of a bank in `kits`, bit i for entry i, of
+    // its first `n`
+    template <typename Bank>
+    uint32_t stepKits(Bank& b, LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames,
+                      uint32_t kits, int n, bool sparse_mode) {
+        uint32_t emitted = 0;
+        for (int i = 0; i < n; i++) {
+            if (!(kits & (1u << i))) continue;
+            b.tempo[i].onset(clock_count + frames);
+            emitted += playStep(b, i, forge, budget, frames, sparse_mode);
+        }
+        advanceCursors(b, kits, n);
+        
+        // Generate new pattern every bar, and at the first bar line after
+        // the rhythm mode changes
+        const bool euclid = getEuclidMode();
+        uint32_t regenerate = 0;
+        for (int i = 0; i < n; i++) {
+            if (!(kits & (1u << i))) continue;
+            bool was_euclid = (euclid_kits >> (b.first_kit + i)) & 1;
+            if (b.current_step[i] == 0 && ((rand() % 4) == 0 || euclid != was_euclid)) {
+                regenerate |= 1u << i;
             }
         }
+        if (regenerate) generateChaoticPattern(b, regenerate);
+        prepareStep(b, n);
+        for (int i = 0; i < n; i++) {
+            if (!(kits & (1u << i))) continue;
+            b.early_hits[i] = 0;
+            queueEarlyHits(b, i, clock_count + frames);
+        }
+        return emitted;
+    }
+    
+    // Play and advance the kits in `kits`, all triggered at `frames`; shared
+    // by MIDI and audio triggers
+    void triggerStep(LV2_Atom_Forge* forge, OutputBudget* budget, uint32_t frames, uint16_t kits, bool sparse_mode) {
+        TRACE_SPAN(span, trace, TRACE_TRIGGER);
+        TRACE_ARG3(span, kits);
+        if (!pending.empty()) flushPending(forge, budget, frames);
+        
+        // The step played by the lowest kit stepped
+        const int32_t position = (kits & 1) ? first.current_step[0] : others->current_step[__builtin_ctz(kits >> 1)];
+        uint32_t emitted = 0;
+        if (kits & 1) emitted += stepKits(first, forge, budget, frames, 1, 1, sparse_mode);
+        if (kits >> 1) emitted += stepKits(*others, forge, budget, frames, kits >> 1, n_kits - 1, sparse_mode);
+        
+        TRACE_ARGS(span, position, emitted);  // Step, notes emitted
+        (void)position;
+        (void)emitted;
     }
     
-    void writeMidiNote(LV2_Atom_Forge* forge, uint32_t frames, uint8_t note, uint8_t velocity, bool note_on) {
+    void writeMidiNote(LV2_Atom_Forge* forge, uint32_t frames, uint8_t note, uint8_t channel,
+                       uint8_t velocity, bool note_on) {
         if (!forge) return;
         
         uint8_t midi_msg[3];
-        midi_msg[0] = (note_on ? 0x90 : 0x80) | 9; // Channel 10 (9 in 0-based)
+        midi_msg[0] = (note_on ? 0x90 : 0x80) | channel;
         midi_msg[1] = note;
         midi_msg[2] = note_on ? velocity : 0;
         
         lv2_atom_forge_frame_time(forge, frames);
+        last_frame = frames;
         lv2_atom_forge_atom(forge, 3, urids.midi_MidiEvent);
         lv2_atom_forge_raw(forge, midi_msg, 3);
         lv2_atom_forge_pad(forge, 3);
     }
-    
+
 public:
-    MidiChaosAmen(double rate, const LV2_Feature* const* features) : 
-        clock_count(0), current_step(0), learn_step(0), learning_active(false), chaos_x(0.5) {
+    MidiChaosAmen(double rate, const LV2_Feature* const* features) :
+        clock_count(0), last_frame(0), n_kits(1), euclid_kits(0), learning_active(false), others(nullptr),
+        schedule(nullptr), kits_requested(false), sample_rate(rate) {
         
         // Initialize all pointers to null for safety
         map = nullptr;
@@ -196,24 +888,49 @@ public:
         learn_mode = nullptr;
         chaos_k = nullptr;
         chaos_intensity = nullptr;
-        kick_velocity = nullptr;
-        snare_velocity = nullptr;
-        hihat_velocity = nullptr;
-        cowbell_velocity = nullptr;
-        tom_low_velocity = nullptr;
-        tom_mid_velocity = nullptr;
-        tom_high_velocity = nullptr;
+        for (int i = 0; i < 7; i++) velocity_ports[i] = nullptr;
+        for (int i = 0; i < 7; i++) {
+            length_ports[i] = nullptr;
+            lane_length[i] = 16;
+        }
         sparsity = nullptr;
+        cc_learn = nullptr;
+        kit_learn = nullptr;
+        kit_count = nullptr;
+        audio_in = nullptr;
+        onset_threshold = nullptr;
+        tempo_bpm = nullptr;
+        tempo_phase = nullptr;
+        rhythm_mode = nullptr;
+        notify = nullptr;
+        chaos_amount = nullptr;
+        ornaments = nullptr;
+        chaos_table = &chaosTable();
+        
+        first.init(0, rate);
+        
+        cc.init();
+        kit_map.setDefaults(drum_notes, GM_DRUM_CHANNEL);
+        onset_detector.init(rate);
         
         // Initialize sparsity tracking
         memset(active_drums, 0, sizeof(active_drums));
+        pending.clear();
         
-        // Get URID map - critical for operation
+        initializePatterns(first);
+        prepareStep();
+#ifdef CHAOS_TRACE
+        trace.init();
+#endif
+
+        // Get URID map - critical for operation - and the worker, if any
         if (features) {
             for (int i = 0; features[i]; i++) {
-                if (features[i]->URI && !strcmp(features[i]->URI, LV2_URID__map)) {
+                if (!features[i]->URI) continue;
+                if (!strcmp(features[i]->URI, LV2_URID__map)) {
                     map = (LV2_URID_Map*)features[i]->data;
-                    break;
+                } else if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+                    schedule = (LV2_Worker_Schedule*)features[i]->data;
                 }
             }
         }
@@ -227,48 +944,102 @@ public:
         urids.atom_Blank = map->map(map->handle, LV2_ATOM__Blank);
         urids.atom_Sequence = map->map(map->handle, LV2_ATOM__Sequence);
         urids.midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+        urids.atom_Chunk = map->map(map->handle, LV2_ATOM__Chunk);
+        urids.state_ccMap = map->map(map->handle, MIDI_CHAOS_AMEN_URI "#cc_map");
+        urids.state_kitMap = map->map(map->handle, MIDI_CHAOS_AMEN_URI "#kit_map");
         
-        // Set safe defaults
-        default_chaos_k = 3.8f;
-        default_chaos_intensity = 0.3f;
-        default_kick_velocity = 100.0f;
-        default_snare_velocity = 90.0f;
-        default_hihat_velocity = 70.0f;
-        default_cowbell_velocity = 80.0f;
-        default_tom_low_velocity = 85.0f;
-        default_tom_mid_velocity = 85.0f;
-        default_tom_high_velocity = 85.0f;
-        
-        initializePatterns();
+        lv2_atom_forge_init(&forge, map);
+        notifier.init(map, MIDI_CHAOS_AMEN_URI, rate, 14, false);
     }
-    
+
+    ~MidiChaosAmen() {
+        free(others);
+#ifdef CHAOS_TRACE
+        trace.dump("amen");
+#endif
+    }
+
     // Safe parameter getters with null checks
     bool getLearnMode() { return learn_mode ? (*learn_mode > 0.5f) : false; }
-    bool getSparsity() { return sparsity ? (*sparsity > 0.5f) : false; }
-    float getChaosK() { return chaos_k ? *chaos_k : default_chaos_k; }
-    float getChaosIntensity() { return chaos_intensity ? *chaos_intensity : default_chaos_intensity; }
-    uint8_t getKickVelocity() { return kick_velocity ? (uint8_t)*kick_velocity : (uint8_t)default_kick_velocity; }
-    uint8_t getSnareVelocity() { return snare_velocity ? (uint8_t)*snare_velocity : (uint8_t)default_snare_velocity; }
-    uint8_t getHihatVelocity() { return hihat_velocity ? (uint8_t)*hihat_velocity : (uint8_t)default_hihat_velocity; }
-    uint8_t getCowbellVelocity() { return cowbell_velocity ? (uint8_t)*cowbell_velocity : (uint8_t)default_cowbell_velocity; }
-    uint8_t getTomLowVelocity() { return tom_low_velocity ? (uint8_t)*tom_low_velocity : (uint8_t)default_tom_low_velocity; }
-    uint8_t getTomMidVelocity() { return tom_mid_velocity ? (uint8_t)*tom_mid_velocity : (uint8_t)default_tom_mid_velocity; }
-    uint8_t getTomHighVelocity() { return tom_high_velocity ? (uint8_t)*tom_high_velocity : (uint8_t)default_tom_high_velocity; }
+    bool getEuclidMode() { return rhythm_mode ? (*rhythm_mode > 0.5f) : false; }
+    bool getSparsity() { return cc.get(CC_PARAM_SPARSITY, sparsity, 0.0f) > 0.5f; }
+    float getChaosK() {
+        // Chaos Amount above zero takes over from the raw K
+        float amount = chaos_amount ? *chaos_amount : 0.0f;
+        if (amount > 0.0f) return chaos_table->kForAmount(amount);
+        return cc.get(CC_PARAM_CHAOS_K, chaos_k, default_chaos_k);
+    }
+    float getChaosIntensity() { return cc.get(CC_PARAM_CHAOS_INTENSITY, chaos_intensity, default_chaos_intensity); }
+    float getOnsetThreshold() {
+        float db = onset_threshold ? fmax(-60.0f, fmin(0.0f, *onset_threshold)) : -20.0f;
+        return powf(10.0f, db / 20.0f);
+    }
+    uint8_t getCCLearn() { return cc_learn ? (uint8_t)fmax(0, fmin(CC_NUM_PARAMS - 1, *cc_learn)) : 0; }
+    uint8_t getKitLearn() { return kit_learn ? (uint8_t)fmax(0, fmin(2 * DrumKit::LANES, *kit_learn)) : 0; }
+    float getOrnaments() { return ornaments ? fmax(0.0f, fmin(1.0f, *ornaments)) : 0.0f; }
+    // One kit until the other kits' bank is in
+    uint8_t getKitCount() {
+        if (!kit_count || !others) return 1;
+        return (uint8_t)fmax(1, fmin(MAX_KITS, *kit_count));
+    }
+    
+    bool hasWorker() const { return schedule != nullptr; }
+    
+    // The other kits' bank, allocated and set up off the audio thread.
+    // Null if there is no memory.
+    static OtherKits* newKitBank(double rate) {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, 64, sizeof(OtherKits)) != 0) return nullptr;
+        OtherKits* kits = new (memory) OtherKits;
+        kits->init(1, rate);
+        return kits;
+    }
+    
+    // Take over a bank from newKitBank(). Called from run()'s thread.
+    bool adoptKits(OtherKits* kits) {
+        if (!kits || others) return false;
+        others = kits;
+        initializePatterns(*others);
+        return true;
+    }
+    
+    // Ask the worker for the other kits' bank the first time Kits goes
+    // above 1. A request the worker cannot meet is not repeated.
+    void requestKits() {
+        if (others || kits_requested || !schedule || !kit_count || *kit_count < 1.5f) return;
+        const uint32_t kits = MAX_KITS - 1;
+        kits_requested = schedule->schedule_work(schedule->handle, sizeof(kits), &kits) == LV2_WORKER_SUCCESS;
+    }
+    
+    // Worker thread: allocate the bank and hand it to workResponse()
+    LV2_Worker_Status work(LV2_Worker_Respond_Function respond, LV2_Worker_Respond_Handle handle) {
+        OtherKits* kits = newKitBank(sample_rate);
+        return respond(handle, sizeof(kits), &kits);
+    }
+    
+    LV2_Worker_Status workResponse(uint32_t size, const void* body) {
+        OtherKits* kits = nullptr;
+        if (size != sizeof(kits)) return LV2_WORKER_ERR_UNKNOWN;
+        memcpy(&kits, body, sizeof(kits));
+        return adoptKits(kits) ? LV2_WORKER_SUCCESS : LV2_WORKER_ERR_UNKNOWN;
+    }
     
     uint8_t getVelocityForDrum(int drum_idx) {
-        switch (drum_idx) {
-            case 0: return getKickVelocity();
-            case 1: return getSnareVelocity();
-            case 2: return getHihatVelocity();
-            case 3: return getCowbellVelocity();
-            case 4: return getTomLowVelocity();
-            case 5: return getTomMidVelocity();
-            case 6: return getTomHighVelocity();
-            default: return 80;
-        }
+        const float* port = velocity_ports[drum_idx];
+        return port ? (uint8_t)*port : default_velocity[drum_idx];
     }
     
     void connectPort(uint32_t port, void* data) {
+        // The audio trigger and notify port are optional and may be
+        // disconnected with NULL
+        if (port == AUDIO_IN) {
+            audio_in = (const float*)data;
+            return;
+        }
+        if (port == NOTIFY) {
+            notify = (LV2_Atom_Sequence*)data;
+            return;
+        }
         if (!data) return; // Safety check
         
         switch (port) {
@@ -277,88 +1048,285 @@ public:
             case LEARN_MODE: learn_mode = (const float*)data; break;
             case CHAOS_K: chaos_k = (const float*)data; break;
             case CHAOS_INTENSITY: chaos_intensity = (const float*)data; break;
-            case KICK_VELOCITY: kick_velocity = (const float*)data; break;
-            case SNARE_VELOCITY: snare_velocity = (const float*)data; break;
-            case HIHAT_VELOCITY: hihat_velocity = (const float*)data; break;
-            case COWBELL_VELOCITY: cowbell_velocity = (const float*)data; break;
-            case TOM_LOW_VELOCITY: tom_low_velocity = (const float*)data; break;
-            case TOM_MID_VELOCITY: tom_mid_velocity = (const float*)data; break;
-            case TOM_HIGH_VELOCITY: tom_high_velocity = (const float*)data; break;
+            case KICK_VELOCITY:
+            case SNARE_VELOCITY:
+            case HIHAT_VELOCITY:
+            case COWBELL_VELOCITY:
+            case TOM_LOW_VELOCITY:
+            case TOM_MID_VELOCITY:
+            case TOM_HIGH_VELOCITY:
+                velocity_ports[port - KICK_VELOCITY] = (const float*)data;
+                break;
+            case KICK_LENGTH:
+            case SNARE_LENGTH:
+            case HIHAT_LENGTH:
+            case COWBELL_LENGTH:
+            case TOM_LOW_LENGTH:
+            case TOM_MID_LENGTH:
+            case TOM_HIGH_LENGTH:
+                length_ports[port - KICK_LENGTH] = (const float*)data;
+                break;
             case SPARSITY: sparsity = (const float*)data; break;
+            case CC_LEARN: cc_learn = (const float*)data; break;
+            case KIT_LEARN: kit_learn = (const float*)data; break;
+            case KITS: kit_count = (const float*)data; break;
+            case ONSET_THRESHOLD: onset_threshold = (const float*)data; break;
+            case TEMPO_BPM: tempo_bpm = (float*)data; break;
+            case TEMPO_PHASE: tempo_phase = (float*)data; break;
+            case RHYTHM_MODE: rhythm_mode = (const float*)data; break;
+            case CHAOS_AMOUNT: chaos_amount = (const float*)data; break;
+            case ORNAMENTS: ornaments = (const float*)data; break;
         }
     }
     
+    LV2_State_Status saveState(LV2_State_Store_Function store, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        LV2_State_Status status = cc.save(store, handle, urids.state_ccMap, urids.atom_Chunk);
+        if (status != LV2_STATE_SUCCESS) return status;
+        return kit_map.save(store, handle, urids.state_kitMap, urids.atom_Chunk);
+    }
+    
+    LV2_State_Status restoreState(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle) {
+        if (!map) return LV2_STATE_ERR_NO_FEATURE;
+        LV2_State_Status status = cc.restore(retrieve, handle, urids.state_ccMap, urids.atom_Chunk);
+        if (status != LV2_STATE_SUCCESS) return status;
+        return kit_map.restore(retrieve, handle, urids.state_kitMap, urids.atom_Chunk);
+    }
+    
     void run(uint32_t n_samples) {
         if (!midi_in || !midi_out || !map) return;
+        TRACE_SPAN(run_span, trace, TRACE_RUN);
         
         // Clear sparsity tracking for this cycle
         memset(active_drums, 0, sizeof(active_drums));
         
+        // Control ports moved by the host take over from earlier CCs
+        cc.sync(CC_PARAM_CHAOS_K, chaos_k);
+        cc.sync(CC_PARAM_CHAOS_INTENSITY, chaos_intensity);
+        cc.sync(CC_PARAM_SPARSITY, sparsity);
+        uint8_t learn_param = getCCLearn();
+        uint8_t learn_lane = getKitLearn();
+        requestKits();
+        uint8_t kit_count_now = getKitCount();
+        if (kit_count_now != n_kits) {
+            // Kits that stop keep nothing queued for a step they will not
+            // play; they are all in the other kits' bank
+            for (int kit = kit_count_now; kit < n_kits; kit++) {
+                dropEarlyHits(*others, kit - 1);
+                others->early_hits[kit - 1] = 0;
+            }
+            if (kit_count_now > n_kits) startKits(n_kits, kit_count_now);
+            n_kits = kit_count_now;
+            prepareStep();
+        }
+        const uint16_t all_kits = (uint16_t)((1u << n_kits) - 1);
+        
         // Check learn mode state change
         bool should_learn = getLearnMode();
-        bool sparse_mode = getSparsity();
         
         if (should_learn && !learning_active) {
             learning_active = true;
-            learn_step = 0;
             clearLearnedPattern();
         } else if (!should_learn && learning_active) {
             learning_active = false;
         }
+        syncLaneLengths();
         
         // Set up forge to write to output
         const uint32_t out_capacity = midi_out->atom.size;
-        LV2_Atom_Forge forge;
-        lv2_atom_forge_init(&forge, map);
         lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_out, out_capacity);
         
         // Start sequence
         LV2_Atom_Forge_Frame seq_frame;
         lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+        last_frame = 0;
+        
+        // Find audio onsets first so they can be merged with MIDI in time order
+        uint32_t onsets[OnsetDetector::MAX_ONSETS];
+        uint32_t n_onsets = 0;
+        uint32_t next_onset = 0;
+        if (audio_in) {
+            TRACE_SPAN(span, trace, TRACE_ONSETS);
+            n_onsets = onset_detector.process(audio_in, n_samples, getOnsetThreshold(), onsets);
+            TRACE_ARGS(span, n_samples, n_onsets);
+        }
+        
+        // Share the output buffer out between this block's triggers. An
+        // audio onset steps every kit.
+        OutputBudget budget;
+        budget.init(out_capacity, countNoteOns(midi_in, urids.midi_MidiEvent) + n_onsets * n_kits);
+        
+        // Note-ons for different kits on the same frame are stepped together.
+        // Anything else in the input steps the waiting kits first.
+        uint16_t waiting = 0;
+        uint32_t waiting_frames = 0;
+        bool waiting_sparse = false;
         
         // Process incoming MIDI
         LV2_ATOM_SEQUENCE_FOREACH(midi_in, ev) {
-            if (ev->body.type == urids.midi_MidiEvent) {
-                const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            const uint8_t* const msg = (const uint8_t*)(ev + 1);
+            const bool is_midi = ev->body.type == urids.midi_MidiEvent;
+            const bool note_on = is_midi && (msg[0] & 0xF0) == 0x90 && msg[2] > 0;
+            const int kit = note_on ? getKitForChannel(msg[0] & 0x0F) : -1;
+            if (waiting && (kit < 0 || ev->time.frames != waiting_frames || (waiting & (1 << kit)))) {
+                triggerStep(&forge, &budget, waiting_frames, waiting, waiting_sparse);
+                waiting = 0;
+            }
+            
+            // Audio onsets up to this event's frame advance the pattern first.
+            // They are not tied to a drum type, so sparsity does not gate them.
+            while (next_onset < n_onsets && onsets[next_onset] <= ev->time.frames) {
+                triggerStep(&forge, &budget, onsets[next_onset++], all_kits, false);
+            }
+            
+            if (is_midi) {
+                // CC modulation takes effect from this frame on
+                if ((msg[0] & 0xF0) == 0xB0) {
+                    cc.controlChange(msg[1], msg[2], learn_param);
+                }
                 
                 // Handle note on for chaos trigger
-                if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
+                if (note_on) {
+                    // Kit learn maps this note before it is dispatched
+                    if (learn_lane >= KIT_LEARN_OUTPUT) {
+                        kit_map.learnOutput(learn_lane - KIT_LEARN_OUTPUT, msg[1], msg[0] & 0x0F);
+                    } else if (learn_lane > 0) {
+                        kit_map.learnInput(learn_lane - 1, msg[1], msg[0] & 0x0F);
+                    }
+                    if (kit < 0) continue;
+                    
                     // Track which drum types are active (for sparsity)
                     int input_drum = getDrumIndex(msg[1]);
                     if (input_drum >= 0) {
-                        active_drums[input_drum] = true;
+                        active_drums[kit] |= 1 << input_drum;
                     }
                     
-                    // Learn from incoming notes
-                    if (learning_active && (msg[0] & 0x0F) == 9) {
-                        if (input_drum >= 0) {
-                            learned_pattern[input_drum][current_step] = true;
-                        }
+                    // Learn from incoming notes, on the learn channel when
+                    // there is one kit and on each kit's own channel otherwise
+                    if (learning_active && (n_kits > 1 || (msg[0] & 0x0F) == kit_map.in_channel)) {
+                        learnFromMidi(kit, input_drum, clock_count + ev->time.frames, msg[2]);
                     }
                     
-                    // Trigger chaotic pattern step
-                    for (int drum = 0; drum < 7; drum++) {
-                        if (current_pattern[drum][current_step]) {
-                            // Sparsity check: only output if this drum type was triggered on input
-                            if (!sparse_mode || active_drums[drum]) {
-                                writeMidiNote(&forge, ev->time.frames, drum_notes[drum], 
-                                            getVelocityForDrum(drum), true);
-                            }
-                        }
-                    }
-                    
-                    current_step = (current_step + 1) % 16;
-                    
-                    // Generate new pattern every bar
-                    if (current_step == 0 && (rand() % 4) == 0) {
-                        generateChaoticPattern();
-                    }
+                    waiting |= 1 << kit;
+                    waiting_frames = ev->time.frames;
+                    waiting_sparse = getSparsity();
                 }
             }
         }
+        if (waiting) triggerStep(&forge, &budget, waiting_frames, waiting, waiting_sparse);
+        
+        // Onsets after the last MIDI event
+        while (next_onset < n_onsets) {
+            triggerStep(&forge, &budget, onsets[next_onset++], all_kits, false);
+        }
+        
+        // Grooved notes falling in the rest of the block
+        if (!pending.empty() && n_samples) flushPending(&forge, &budget, n_samples - 1);
         
         lv2_atom_forge_pop(&forge, &seq_frame);
+        
+        if (notify) {
+            TRACE_SPAN(span, trace, TRACE_NOTIFY);
+            // The first kit's lane bitmasks as they stand at the end of the
+            // block, low and high word of each lane
+            StateSnapshot snapshot = {};
+            snapshot.step = first.step_count[0];
+            snapshot.chord = -1;
+            snapshot.chaos = (float)first.chaos_x[0];
+            for (int drum = 0; drum < 7; drum++) {
+                snapshot.lanes[2 * drum] = (uint32_t)first.current_pattern[drum][0];
+                snapshot.lanes[2 * drum + 1] = (uint32_t)(first.current_pattern[drum][0] >> 32);
+            }
+            bool published = notifier.run(notify, clock_count, n_samples ? n_samples - 1 : 0, snapshot);
+            TRACE_ARGS(span, published, 0);
+            (void)published;
+        }
+        
+        clock_count += n_samples;
+        if (tempo_bpm) *tempo_bpm = first.tempo[0].bpm();
+        if (tempo_phase) *tempo_phase = first.tempo[0].phase(clock_count);
+        TRACE_ARGS(run_span, traceCountEvents(midi_in), traceCountEvents(midi_out));
     }
+
+#ifdef CHAOS_FOOTPRINT
+    // Mark the members run() reads and writes, per block and per trigger
+    static void reportFootprint() {
+        MidiChaosAmen instance(48000.0, nullptr);
+        MidiChaosAmen* p = &instance;
+        if (!p->adoptKits(newKitBank(48000.0))) return;
+        FootprintReport report(p, sizeof(MidiChaosAmen));
+        report.allocated(*p->others, "once Kits goes above 1");
+        report.shared(amen_pattern);
+        report.shared(drum_notes);
+        report.shared(default_velocity);
+        report.shared(drum_priority);
+        report.shared(euclid_hits);
+        report.shared(ornament_weight);
+        report.shared(euclid_table);
+        report.shared(chaosTable());
+        
+        report.block(p->midi_in);
+        report.block(p->midi_out);
+        report.block(p->forge);
+        report.block(p->urids);
+        report.block(p->clock_count);
+        report.block(p->cc.params);
+        report.block(p->chaos_k);
+        report.block(p->chaos_intensity);
+        report.block(p->sparsity);
+        report.block(p->cc_learn);
+        report.block(p->kit_learn);
+        report.block(p->kit_count);
+        report.block(p->kit_map.lane_of);
+        report.block(p->kit_map.in_channel);
+        report.block(p->learn_mode);
+        report.block(p->audio_in);
+        report.block(p->tempo_bpm);
+        report.block(p->tempo_phase);
+        report.block(p->n_kits);
+        report.block(p->others);
+        report.block(p->kits_requested);
+        report.block(p->active_drums);
+        report.block(p->learning_active);
+        report.block(p->map);
+        report.block(p->notify);
+        report.block(p->notifier);
+        report.block(p->pending.count);
+        report.block(p->length_ports);
+        report.block(p->first.tempo[0].period);
+        report.block(p->first.tempo[0].last_onset);
+        report.block(p->first.tempo[0].step_count);
+        report.block(p->first.tempo[0].steps_per_beat);
+        report.block(p->first.tempo[0].rate);
+        
+        // One kit running: kit 0's arrays in the instance. The other kits'
+        // bank is only touched by their own triggers.
+        report.trigger(p->first.chaos_x);
+        report.trigger(p->first.current_step);
+        report.trigger(p->first.step_count);
+        report.trigger(p->first.current_pattern);
+        report.trigger(p->first.lane_cursor);
+        report.trigger(p->first.step_hits);
+        report.trigger(p->first.early_hits);
+        report.trigger(p->first.first_kit);
+        report.trigger(p->lane_length);
+        report.trigger(p->euclid_kits);
+        report.trigger(p->rhythm_mode);
+        report.trigger(p->chaos_amount);
+        report.trigger(p->ornaments);
+        report.trigger(p->chaos_table);
+        report.trigger(p->velocity_ports);
+        report.trigger(p->kit_map.out_note);
+        report.trigger(p->kit_map.out_channel);
+        report.trigger(p->first.tempo[0].next_step);
+        report.trigger(p->first.tempo[0].prev_ioi);
+        report.trigger(p->first.tempo[0].hist_weight);
+        report.trigger(p->first.tempo[0].peak_bin);
+        report.trigger(p->first.tempo[0].hist[0]);  // One histogram bin per onset
+        
+        report.print("MidiChaosAmen");
+    }
+#endif
 };
 
 // LV2 C interface
@@ -368,7 +1336,18 @@ static LV2_Handle instantiate(const LV2_Descriptor* descriptor,
                              double rate,
                              const char* bundle_path,
                              const LV2_Feature* const* features) {
-    return new MidiChaosAmen(rate, features);
+    // Aligned so hundreds of instances do not share or straddle cache lines
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(MidiChaosAmen), sizeof(MidiChaosAmen)) != 0) return NULL;
+    MidiChaosAmen* plugin = new (memory) MidiChaosAmen(rate, features);
+    // Without a worker the Kits port can only bring in the other kits if
+    // their bank is allocated here
+    if (!plugin->hasWorker() && !plugin->adoptKits(MidiChaosAmen::newKitBank(rate))) {
+        plugin->~MidiChaosAmen();
+        free(memory);
+        return NULL;
+    }
+    return plugin;
 }
 
 static void connect_port(LV2_Handle instance, uint32_t port, void* data) {
@@ -393,11 +1372,45 @@ static void deactivate(LV2_Handle instance) {
 
 static void cleanup(LV2_Handle instance) {
     if (instance) {
-        delete (MidiChaosAmen*)instance;
+        ((MidiChaosAmen*)instance)->~MidiChaosAmen();
+        free(instance);
     }
 }
 
+static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store,
+                             LV2_State_Handle handle, uint32_t flags,
+                             const LV2_Feature* const* features) {
+    if (!instance) return LV2_STATE_ERR_UNKNOWN;
+    return ((MidiChaosAmen*)instance)->saveState(store, handle);
+}
+
+static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
+                                LV2_State_Handle handle, uint32_t flags,
+                                const LV2_Feature* const* features) {
+    if (!instance) return LV2_STATE_ERR_UNKNOWN;
+    return ((MidiChaosAmen*)instance)->restoreState(retrieve, handle);
+}
+
+static LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function respond,
+                              LV2_Worker_Respond_Handle handle, uint32_t size, const void* data) {
+    if (!instance) return LV2_WORKER_ERR_UNKNOWN;
+    return ((MidiChaosAmen*)instance)->work(respond, handle);
+}
+
+static LV2_Worker_Status work_response(LV2_Handle instance, uint32_t size, const void* body) {
+    if (!instance) return LV2_WORKER_ERR_UNKNOWN;
+    return ((MidiChaosAmen*)instance)->workResponse(size, body);
+}
+
 static const void* extension_data(const char* uri) {
+    static const LV2_State_Interface state = { save, restore };
+    static const LV2_Worker_Interface worker = { work, work_response, NULL };
+    if (!strcmp(uri, LV2_STATE__interface)) {
+        return &state;
+    }
+    if (!strcmp(uri, LV2_WORKER__interface)) {
+        return &worker;
+    }
     return NULL;
 }
 
@@ -420,3 +1433,10 @@ LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
 }
 
 } // extern "C"
+
+#ifdef CHAOS_FOOTPRINT
+int main() {
+    MidiChaosAmen::reportFootprint();
+    return 0;
+}
+#endif
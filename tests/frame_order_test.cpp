@@ -0,0 +1,114 @@
+// Output events of the drum plugin must never go back in time within a
+// block: learned early hits under swing, notes held over a full buffer and
+// triggers resuming after a pause all go out in frame order.
+// Built with midi_chaos_amen.cpp; run with `make test`.
+#include <lv2/core/lv2.h>
+#include <lv2/atom/forge.h>
+#include <lv2/midi/midi.h>
+#include <lv2/urid/urid.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Defined by the plugin this test is linked with
+extern "C" const LV2_Descriptor* lv2_descriptor(uint32_t index);
+
+static std::vector<std::string> uris;
+
+static LV2_URID map(LV2_URID_Map_Handle, const char* uri) {
+    for (size_t i = 0; i < uris.size(); i++) {
+        if (uris[i] == uri) return (LV2_URID)(i + 1);
+    }
+    uris.push_back(uri);
+    return (LV2_URID)uris.size();
+}
+
+static const double RATE = 48000.0;
+static const double PERIOD = 6000.0;  // 16ths at 120 BPM
+static const uint32_t BLOCK = 256;
+
+struct Trigger {
+    uint64_t time;
+    uint8_t note;
+};
+
+// 24 bars of 16ths in learn mode, odd steps `swing` samples late and hats
+// `early` samples early, with a six-step pause every four bars. Returns
+// the number of events written before an earlier one in their block.
+static int checkFrameOrder(double swing, double early) {
+    LV2_URID_Map urid_map = {nullptr, map};
+    LV2_Feature map_feature = {LV2_URID__map, &urid_map};
+    const LV2_Feature* features[] = {&map_feature, nullptr};
+    const LV2_Descriptor* desc = lv2_descriptor(0);
+    LV2_Handle plugin = desc->instantiate(desc, RATE, "", features);
+
+    alignas(8) static uint8_t in[8192];
+    alignas(8) static uint8_t out[8192];
+    float ports[31] = {};
+    for (uint32_t port = 2; port < 31; port++) desc->connect_port(plugin, port, &ports[port]);
+    desc->connect_port(plugin, 0, in);
+    desc->connect_port(plugin, 1, out);
+    desc->connect_port(plugin, 14, nullptr);  // No audio triggers
+    desc->connect_port(plugin, 19, nullptr);  // No notify output
+    ports[2] = 1.0f;                          // Learn
+    ports[3] = 3.9f;                          // Chaos K
+    ports[4] = 0.8f;                          // Intensity
+    for (int port = 5; port < 12; port++) ports[port] = 100.0f;
+    for (int port = 21; port < 28; port++) ports[port] = 16.0f;
+    ports[29] = 1.0f;                         // Kits
+    ports[30] = 0.8f;                         // Ornaments
+
+    std::vector<Trigger> triggers;
+    for (int step = 0; step < 16 * 24; step++) {
+        if (step % 64 >= 40 && step % 64 < 46) continue;
+        bool hat = (step % 4) == 2;
+        double time = 1000.0 + step * PERIOD + ((step & 1) ? swing : 0.0) - (hat ? early : 0.0);
+        triggers.push_back({(uint64_t)time, (uint8_t)(hat ? 42 : (step % 8 ? 38 : 36))});
+    }
+
+    LV2_Atom_Forge forge;
+    lv2_atom_forge_init(&forge, &urid_map);
+    const LV2_URID midi_event = map(nullptr, LV2_MIDI__MidiEvent);
+    size_t next = 0;
+    int failures = 0;
+    for (uint64_t now = 0; next < triggers.size(); now += BLOCK) {
+        LV2_Atom_Forge_Frame frame;
+        lv2_atom_forge_set_buffer(&forge, in, sizeof(in));
+        lv2_atom_forge_sequence_head(&forge, &frame, 0);
+        for (; next < triggers.size() && triggers[next].time < now + BLOCK; next++) {
+            const uint8_t msg[3] = {0x99, triggers[next].note, 100};
+            lv2_atom_forge_frame_time(&forge, triggers[next].time - now);
+            lv2_atom_forge_atom(&forge, 3, midi_event);
+            lv2_atom_forge_write(&forge, msg, 3);
+        }
+        lv2_atom_forge_pop(&forge, &frame);
+
+        // Room for three notes, so some are held over a block
+        ((LV2_Atom*)out)->size = sizeof(LV2_Atom_Sequence_Body) + 3 * 24;
+        desc->run(plugin, BLOCK);
+
+        int64_t last = 0;
+        const LV2_Atom_Sequence* seq = (const LV2_Atom_Sequence*)out;
+        LV2_ATOM_SEQUENCE_FOREACH(seq, ev) {
+            if (ev->time.frames < last || ev->time.frames >= BLOCK) failures++;
+            last = ev->time.frames;
+        }
+    }
+    desc->cleanup(plugin);
+    return failures;
+}
+
+int main() {
+    const double swings[] = {0.0, 600.0, 750.0, 900.0, 1050.0, 1200.0};
+    const double earlies[] = {600.0, 900.0, 1200.0};
+    int failures = 0;
+    for (double swing : swings) {
+        for (double early : earlies) {
+            int out_of_order = checkFrameOrder(swing, early);
+            printf("%s swing %4.0f, hats %4.0f early: %d events out of order\n",
+                   out_of_order ? "FAIL" : "ok  ", swing, early, out_of_order);
+            failures += out_of_order;
+        }
+    }
+    return failures ? 1 : 0;
+}
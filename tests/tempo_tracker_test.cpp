@@ -0,0 +1,61 @@
+// TempoTracker against steady, swung and changing trigger streams.
+// Build and run with `make test`.
+#include "tempo_tracker.h"
+#include <stdio.h>
+
+static const double RATE = 48000.0;
+static const double PERIOD = 6000.0;  // 16ths at 120 BPM
+
+static int failures = 0;
+
+static void expectBpm(const char* what, const TempoTracker& tempo, double bpm) {
+    bool ok = fabs(tempo.bpm() - bpm) < 0.01 * bpm;
+    printf("%s %-40s %6.1f BPM (want %.1f)\n", ok ? "ok  " : "FAIL", what, tempo.bpm(), bpm);
+    if (!ok) failures++;
+}
+
+// 64 steps, odd steps `swing` samples late; `short_first` starts on a
+// short interval
+static void swungSteps(TempoTracker* tempo, uint64_t* time, double period, double swing,
+                       bool short_first, int steps = 64) {
+    for (int step = 0; step < steps; step++) {
+        double offset = ((step & 1) != short_first) ? swing : 0.0;
+        tempo->onset(*time + (uint64_t)(step * period + offset));
+    }
+    *time += (uint64_t)(steps * period);
+}
+
+int main() {
+    const double swings[] = {0.0, 750.0, 900.0, 1200.0, 1800.0};
+    for (double swing : swings) {
+        for (int short_first = 0; short_first < 2; short_first++) {
+            TempoTracker tempo;
+            tempo.init(RATE, 4);
+            uint64_t time = 1000;
+            swungSteps(&tempo, &time, PERIOD, swing, short_first);
+            char what[64];
+            snprintf(what, sizeof(what), "swing %.0f, %s interval first", swing, short_first ? "short" : "long");
+            expectBpm(what, tempo, 120.0);
+        }
+    }
+
+    // A sustained change re-locks within a few triggers
+    TempoTracker tempo;
+    tempo.init(RATE, 4);
+    uint64_t time = 1000;
+    swungSteps(&tempo, &time, PERIOD, 0.0, false);
+    swungSteps(&tempo, &time, PERIOD * 0.75, 0.0, false, 16);
+    expectBpm("16 steps after 120 -> 160 BPM", tempo, 160.0);
+    swungSteps(&tempo, &time, PERIOD * 1.5, 600.0, true, 16);
+    expectBpm("16 swung steps after 160 -> 80 BPM", tempo, 80.0);
+
+    // Occasional skipped steps keep the tempo
+    tempo.init(RATE, 4);
+    time = 1000;
+    for (int step = 0; step < 64; step++) {
+        if (step % 5 != 3) tempo.onset(time + (uint64_t)(step * PERIOD));
+    }
+    expectBpm("every fifth step skipped", tempo, 120.0);
+
+    return failures ? 1 : 0;
+}